@@ -6,23 +6,74 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 
 #define KILO_VERSION "1.0"
 #define TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_OVERWRITE_TIMES 1
+// most line edits the reload diff will resolve before replacing the whole span
+#define RELOAD_MAX_EDITS 256
+// default cap on redraws per second, --fps overrides it
+#define FRAME_RATE 60
+// files with fewer rows are never packed into cold blocks
+#define COLD_MIN_ROWS 20000
+// rows this close to the viewport or cursor stay uncompressed
+#define COLD_WINDOW 2000
+// keypresses after its last edit or view before a row may be packed
+#define COLD_AGE 512
+#define COLD_BLOCK_ROWS 512
+#define COLD_BLOCK_BYTES 65536
+// per idle step: rows looked at and blocks compressed at most
+#define COLD_SCAN 65536
+#define COLD_BATCH 16
+#define COLD_HASH_BITS 12
+// completions offered per prefix, most frequent first
+#define COMPLETE_MAX 16
+// with --index, files with at least this many rows get a trigram index
+#define TRI_MIN_ROWS 20000
+// fewest rows per block, the unit the index narrows searches to
+#define TRI_BLOCK_ROWS 256
+// bytes a block covers at least, so postings stay a fraction of the file
+#define TRI_BLOCK_BYTES (256 * 1024)
+#define TRI_BUCKETS 65536
+// bits per block summarizing the trigrams its edited rows gained
+#define TRI_OVERLAY_BITS 8192
+// most threads a sort uses, and the fewest rows worth giving one
+#define SORT_THREADS 16
+#define SORT_MIN_RUN 16384
+// columns the changed-line gutter takes off the text
+#define GUTTER_COLS 2
+// saved lines kept from each end of a longer run between two shown rows
+#define GUTTER_RUN 32
+// live bytes past which hidden buffers are packed, then dropped; --budget in MiB
+#define BUFFER_BUDGET (256LL << 20)
 // Masks first 5 bits of character to convert char to C-char
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -50,9 +101,47 @@ enum editorHighlight {
 	HL_MATCH
 };
 
+enum profStage {
+	PROF_INPUT = 0,
+	PROF_SYNTAX,
+	PROF_DRAW,
+	PROF_WRITE,
+	PROF_FRAME,
+	PROF_BYTES,
+	PROF_STAGES
+};
+
+// log-linear buckets, four per power of two up to 2^63
+#define PROF_BUCKETS 252
+
+enum memKind {
+	MEM_CHARS = 0,
+	MEM_RENDER,
+	MEM_HL,
+	MEM_ROWS,
+	MEM_ABUF,
+	MEM_SEARCH,
+	MEM_PROMPT,
+	MEM_SYNTAX,
+	MEM_INDEX,
+	MEM_COLD,
+	MEM_WORDS,
+	MEM_KINDS
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// longest comment-state cascade resolved inline before handing it to the worker
+#define HL_SYNC_BUDGET 256
+
+#define SDB_MAGIC "KSDB"
+#define SDB_VERSION 1
+#define SDB_CACHE ".kilo-syntax-cache"
+
+#define TRI_MAGIC "KTRI"
+#define TRI_VERSION 2
+
 /*** data ***/
 
 struct editorSyntax {
@@ -63,37 +152,448 @@ struct editorSyntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	// keywords grouped by first byte: [kwindex[c], kwindex[c + 1])
+	uint16_t *kwindex;
+};
+
+// LZ-compressed chars of consecutive rows that have not been used for a while
+struct coldBlock {
+	// rows still pointing into the block
+	int refs;
+	int rawlen;
+	int len;
+	char data[];
+};
+
+// change in bracket depth over a run of text and the lowest depth within it
+struct bracketSum {
+	int net;
+	int min;
 };
 
 typedef struct erow {
 	int idx;
 	int size;
 	int rsize;
+	// no byte above 0x7f, so bytes, characters and columns coincide
+	int ascii;
 	char *chars;
 	char *render;
 	unsigned char *hl;
-	int hl_open_comment;
+	// comment state hl was computed for, -1 while hl is not allocated, -2 when stale
+	int hl_in;
+	uint64_t hash;
+	// while packed, chars, render and hl are NULL and the bytes are in cold
+	struct coldBlock *cold;
+	int cold_off;
+	// key count at the last edit or view, 0 for rows untouched since loading
+	unsigned int stamp;
+	// the row's words are counted in the word index
+	int indexed;
+	// display columns of render
+	int cols;
+	// holds characters two columns wide, which wrapping may not split
+	int wide;
+	// trigram index block, never decreasing from one row to the next
+	int tri;
+	// bracket summaries for a row starting outside and inside a block comment
+	struct bracketSum brk[2];
+	int brk_valid;
+	// saved line the row descends from, inserted rows take the one above's
+	int base;
 } erow;
 
+/*
+ * a Fenwick tree of some per-row quantity. row insertions shift every entry
+ * after them, so instead of updating those the tree only remembers the
+ * lowest row it is no longer exact for and rebuilds from there on demand.
+ */
+struct fenwick {
+	long long *tree;
+	int cap;
+	int stale;
+	long long (*value)(erow *row);
+};
+
 struct editorConfig {
 	int cx, cy;
 	int rx;
 	int rowoff;
 	int coloff;
+	// soft wrap, the screen then starts at wrapped line wrapoff of rowoff
+	int wrap;
+	int wrapoff;
 	struct termios orig_termios;
 	int screenrows;
 	int screencols;
 	int numrows;
-	char statusmsg[80];
+	char statusmsg[256];
 	time_t statusmsg_time;
+	// an open prompt keeps the message bar, even over the latency overlay
+	int prompting;
 	erow *row;
+	int rowcap;
 	char *filename;
 	int dirty;
 	struct editorSyntax *syntax;
+	/*
+	 * block comment state per row, kept outside erow so it can be copied
+	 * cheaply for the highlighter thread. hl_trans[i] bit n is the state at
+	 * the end of row i when it starts in state n; hl_state[i] is the actual
+	 * end state and is correct below hl_valid. rows from hl_valid up to
+	 * hl_dirty changed since the states were last complete.
+	 */
+	unsigned char *hl_trans;
+	unsigned char *hl_state;
+	int hl_valid;
+	int hl_dirty;
+	unsigned long hl_version;
+	// bytes per row including the newline, for byte offsets
+	struct fenwick offsets;
+	// screen lines per row when wrapped, for mapping screen lines to rows
+	struct fenwick layout;
+	// while set, transitions are only marked and computed in one batch later
+	int hl_defer;
+	int hl_pending;
+	// on-disk identity of filename as of the last open/save/reload
+	int file_known;
+	dev_t file_dev;
+	ino_t file_ino;
+	off_t file_size;
+	struct timespec file_mtime;
+	time_t file_checked;
+	int file_conflict;
+	// socket of the client a server child runs for, 0 in a plain editor
+	int client;
+	// scripted input and in-memory output for headless runs
+	int headless;
+	int *keys;
+	int keys_len;
+	int keys_pos;
+	int keys_cap;
+	char *sink;
+	int sinklen;
+	long long sink_total;
+	// frames are at least this many microseconds apart
+	long long frame_interval;
+	long long frame_last;
+	// build trigram indexes for large files, --index
+	int trigrams;
+	// row hashes as of the last open/save/reload, for the changed-line gutter
+	uint64_t *saved;
+	int nsaved;
+	int gutter;
 };
 
 struct editorConfig config;
 
+// a snapshot of comment transitions handed to the highlighter thread
+struct hlJob {
+	unsigned long version;
+	int start;
+	int count;
+	// states may settle back onto old ones from here on
+	int converge;
+	int in;
+	unsigned char *trans;
+	unsigned char *old;
+	unsigned char *state;
+	int done;
+	int converged;
+};
+
+struct editorHighlighter {
+	pthread_t thread;
+	pid_t pid;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct hlJob *pending;
+	// handed back without locking, one job in flight at a time
+	struct hlJob *result;
+	int busy;
+	// hands out hl_version values, unique across buffers
+	unsigned long version;
+};
+
+struct editorHighlighter highlighter = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER
+};
+
+struct editorProfile {
+	int enabled;
+	int overlay;
+	char *dump;
+	long long frame[PROF_STAGES];
+	unsigned long long hist[PROF_STAGES][PROF_BUCKETS];
+	unsigned long long frames;
+};
+
+struct editorProfile profile;
+
+char *PROF_NAMES[] = { "input", "syntax", "draw", "write", "frame", "bytes" };
+
+struct editorMemory {
+	char *dump;
+	long long live[MEM_KINDS];
+	long long peak[MEM_KINDS];
+};
+
+struct editorMemory memory;
+
+struct editorMacro {
+	int recording;
+	int replaying;
+	int *keys;
+	int len;
+	int cap;
+};
+
+struct editorMacro macro;
+
+struct editorCold {
+	// the last block decompressed, so neighbouring rows reuse it
+	struct coldBlock *cached;
+	char *buf;
+	int bufcap;
+	// a packed row's render text, for scans that do not thaw it
+	char *render;
+	int rendercap;
+	int scan;
+	// rows looked at since a block was last packed
+	int idle;
+	unsigned int clock;
+};
+
+struct editorCold cold;
+
+struct wordEntry {
+	uint64_t hash;
+	char *word;
+	int len;
+	// occurrences in the buffer, 0 for a free slot and -1 for a removed one
+	int count;
+	// neighbours among the words sharing the first two bytes
+	int next;
+	int prev;
+};
+
+/*
+ * every word in the buffer with its count, open addressing with linear
+ * probing. words are also chained by their first two bytes so a prefix
+ * only visits the words that can match.
+ */
+struct editorWords {
+	struct wordEntry *table;
+	int cap;
+	int used;
+	int removed;
+	int *heads;
+	// rows not indexed yet, which the idle loop works through from scan
+	int pending;
+	int scan;
+};
+
+struct editorWords words;
+
+struct editorComplete {
+	char *cands[COMPLETE_MAX];
+	int n;
+	int pick;
+	// the completed prefix ends at cx on row cy, followed by inserted bytes
+	int cy;
+	int cx;
+	int inserted;
+	unsigned int clock;
+};
+
+struct editorComplete complete;
+
+struct editorBrackets {
+	// segment tree of row summaries, node 1 is the root and leaves start at size.
+	// the unused leaves form a gap before row gap, so inserting or deleting a
+	// row only shifts the leaves between the edit and the last one
+	struct bracketSum *tree;
+	int size;
+	int gap;
+	int gaplen;
+	// set when the leaves must be rebuilt in full, e.g. after a sort
+	int stale;
+	// rows without summaries; once none are left edits update theirs directly
+	int pending;
+	int scan;
+	int active;
+	unsigned char *scratch;
+	int scratchcap;
+	// partner of the bracket under the cursor, match_row -1 if there is none
+	int match_row;
+	int match_off;
+};
+
+struct editorBrackets brackets = { .match_row = -1 };
+
+// on-disk layout of a trigram sidecar: this, bucket offsets, then postings
+struct triHeader {
+	char magic[4];
+	uint32_t version;
+	// the file as it was indexed
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	uint32_t block_rows;
+	uint32_t blocks;
+	uint64_t npostings;
+	uint64_t size;
+};
+
+struct editorTrigrams {
+	// 0 without an index, 1 while the idle loop builds it, 2 once it is usable
+	int state;
+	int blocks;
+	struct triHeader key;
+	// blocks built so far, with the distinct buckets of block b from starts[b] in list
+	int next;
+	uint16_t *list;
+	size_t listlen;
+	size_t listcap;
+	size_t *starts;
+	unsigned char *seen;
+	// bucket k lists its blocks in postings from offsets[k] up to offsets[k + 1]
+	char *image;
+	size_t len;
+	int mapped;
+	uint64_t *offsets;
+	uint32_t *postings;
+	// per block, the buckets rows edited this session added
+	unsigned char **overlay;
+	// blocks that may hold query
+	uint64_t *cand;
+	char *query;
+	int narrowed;
+};
+
+struct editorTrigrams trigrams;
+
+// a row to sort, key orders it before the row itself has to be compared
+struct sortItem {
+	uint64_t key;
+	erow *row;
+	// the row's text, which packed rows have in a block decoded for the sort
+	const char *data;
+};
+
+// packed blocks the rows being sorted point into, each decoded once
+struct sortBlocks {
+	struct coldBlock **block;
+	char **raw;
+	int len;
+	int cap;
+};
+
+struct editorSorter {
+	int numeric;
+	int reverse;
+	int unique;
+};
+
+struct editorSorter sorter;
+
+enum gutterMark {
+	GUTTER_ADDED = 1,
+	GUTTER_MODIFIED = 2,
+	// saved lines were removed right above the row, or below the last one
+	GUTTER_DELETED = 4,
+	GUTTER_DELETED_BELOW = 8
+};
+
+// marks for the rows on screen and the diff's scratch space
+struct editorGutter {
+	int top;
+	int count;
+	unsigned char *marks;
+	uint64_t *a;
+	uint64_t *b;
+	// saved lines cut out of a long run right before a[j]
+	int *cut;
+	int *keep;
+	int *v;
+	int cap;
+};
+
+struct editorGutter gutter;
+
+struct sortTask {
+	// sorts a in place using tmp, or merges x and y into out when x is set
+	struct sortItem *a;
+	struct sortItem *tmp;
+	int n;
+	const struct sortItem *x;
+	const struct sortItem *y;
+	int nx;
+	int ny;
+	struct sortItem *out;
+};
+
+// what a buffer owns while another one is shown
+struct editorBuffer {
+	struct editorConfig config;
+	struct editorWords words;
+	struct editorBrackets brackets;
+	struct editorTrigrams trigrams;
+	// every row packed, or rows dropped to be reread from filename when shown
+	int packed;
+	int unloaded;
+	unsigned int used;
+};
+
+struct editorBuffers {
+	// empty until a second buffer is added, the shown one's entry is stale
+	struct editorBuffer *list;
+	int len;
+	int cap;
+	int current;
+	unsigned int clock;
+	long long budget;
+};
+
+struct editorBuffers buffers = { .budget = BUFFER_BUDGET };
+
+char *MEM_NAMES[] = { "chars", "render", "hl", "rows", "abuf", "search", "prompt", "syntax", "index", "cold", "words" };
+
+// code points that do not take up exactly one column, sorted by first
+struct charWidth {
+	int first;
+	int last;
+	int width;
+};
+
+struct charWidth CHAR_WIDTHS[] = {
+	{ 0x0300, 0x036f, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05bd, 0 },
+	{ 0x05bf, 0x05c7, 0 }, { 0x0610, 0x061a, 0 }, { 0x064b, 0x065f, 0 },
+	{ 0x0670, 0x0670, 0 }, { 0x06d6, 0x06dc, 0 }, { 0x06df, 0x06e4, 0 },
+	{ 0x0900, 0x0902, 0 }, { 0x093a, 0x093c, 0 }, { 0x0941, 0x0948, 0 },
+	{ 0x094d, 0x094d, 0 }, { 0x0e31, 0x0e31, 0 }, { 0x0e34, 0x0e3a, 0 },
+	{ 0x0e47, 0x0e4e, 0 }, { 0x1100, 0x115f, 2 }, { 0x1ab0, 0x1aff, 0 },
+	{ 0x1dc0, 0x1dff, 0 }, { 0x200b, 0x200f, 0 }, { 0x202a, 0x202e, 0 },
+	{ 0x2060, 0x2064, 0 }, { 0x20d0, 0x20ff, 0 }, { 0x231a, 0x231b, 2 },
+	{ 0x2329, 0x232a, 2 }, { 0x23e9, 0x23ec, 2 }, { 0x25fd, 0x25fe, 2 },
+	{ 0x2614, 0x2615, 2 }, { 0x26aa, 0x26ab, 2 }, { 0x26bd, 0x26be, 2 },
+	{ 0x2705, 0x2705, 2 }, { 0x270a, 0x270b, 2 }, { 0x274c, 0x274c, 2 },
+	{ 0x2b1b, 0x2b1c, 2 }, { 0x2e80, 0x303e, 2 }, { 0x3041, 0x3096, 2 },
+	{ 0x3099, 0x309a, 0 }, { 0x309b, 0x33ff, 2 }, { 0x3400, 0x4dbf, 2 },
+	{ 0x4e00, 0x9fff, 2 }, { 0xa000, 0xa4cf, 2 }, { 0xa960, 0xa97f, 2 },
+	{ 0xac00, 0xd7a3, 2 }, { 0xf900, 0xfaff, 2 }, { 0xfe00, 0xfe0f, 0 },
+	{ 0xfe10, 0xfe19, 2 }, { 0xfe20, 0xfe2f, 0 }, { 0xfe30, 0xfe6f, 2 },
+	{ 0xfeff, 0xfeff, 0 }, { 0xff00, 0xff60, 2 }, { 0xffe0, 0xffe6, 2 },
+	{ 0x16fe0, 0x16fe4, 2 }, { 0x17000, 0x18cff, 2 }, { 0x1b000, 0x1b2ff, 2 },
+	{ 0x1f004, 0x1f004, 2 }, { 0x1f0cf, 0x1f0cf, 2 }, { 0x1f18e, 0x1f18e, 2 },
+	{ 0x1f191, 0x1f19a, 2 }, { 0x1f200, 0x1f251, 2 }, { 0x1f300, 0x1f64f, 2 },
+	{ 0x1f680, 0x1f6ff, 2 }, { 0x1f7e0, 0x1f7eb, 2 }, { 0x1f900, 0x1faff, 2 },
+	{ 0x20000, 0x2fffd, 2 }, { 0x30000, 0x3fffd, 2 }, { 0xe0001, 0xe007f, 0 },
+	{ 0xe0100, 0xe01ef, 0 }
+};
+
 /*** filetypes ***/
 
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
@@ -110,17 +610,87 @@ struct editorSyntax HLDB[] = {
 		C_HL_extensions,
 		C_HL_keywords,
 		"//", "/*", "*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL
 	},
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+/*** syntax database ***/
+
+// on-disk layout of the compiled syntax cache, all offsets from the image start
+struct sdbHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t signature;
+	uint32_t size;
+	uint32_t nsyntax;
+	uint32_t syntax_off;
+	uint32_t strtab_off;
+	uint32_t ext_slots;
+	uint32_t ext_off;
+	uint32_t npatterns;
+	uint32_t pattern_off;
+	uint32_t pool_off;
+};
+
+struct sdbSyntax {
+	// pool offsets, 0 is the empty string and means unset
+	uint32_t filetype;
+	uint32_t scs;
+	uint32_t mcs;
+	uint32_t mce;
+	uint32_t flags;
+	// ranges of the string table
+	uint32_t filematch;
+	uint32_t nfilematch;
+	uint32_t keywords;
+	uint32_t nkeywords;
+	uint16_t kwindex[257];
+	uint16_t pad;
+};
+
+// extension hash slot or substring pattern, syntax is index + 1
+struct sdbMatch {
+	uint32_t hash;
+	uint32_t str;
+	uint32_t syntax;
+};
+
+struct editorSyntaxDB {
+	char *image;
+	size_t len;
+	int mapped;
+	struct sdbHeader *hdr;
+	// materialized on first use
+	struct editorSyntax *syntax;
+	char *ready;
+};
+
+struct editorSyntaxDB sdb;
+
 /*** prototypes ***/
 
 void editorSetMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptWith(char *prompt, void (*callback)(char *, int), int allow_empty);
+void editorRecordFileStat();
+uint64_t editorHashBytes(const char *s, size_t len);
+void editorProcessKeypress();
+void editorSyntaxFlush();
+void editorBracketsSet(int at);
+void editorFreeRow(erow *row);
+void editorRenderRow(erow *row);
+void editorRowStep(erow *row, int *cx, int *rx, int *roff);
+void editorRowThaw(erow *row);
+char *editorRowRender(erow *row, int *rsize);
+int editorRowCxToRender(erow *row, int cx);
+int editorRowRenderToCx(erow *row, int roff);
+void editorInitBuffer();
+long long editorNow();
+void editorGutterRebase();
 
 /*** terminal ***/
 
@@ -161,12 +731,49 @@ void enableRawMode() {
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
+// appends a key to the scripted input read by editorReadKey
+void editorQueueKey(int key) {
+	if (config.keys_len == config.keys_cap) {
+		config.keys_cap = config.keys_cap ? config.keys_cap * 2 : 64;
+		config.keys = realloc(config.keys, sizeof(int) * config.keys_cap);
+	}
+	config.keys[config.keys_len++] = key;
+}
+
+// the read timeout also returns nothing, only poll tells a hangup apart
+int editorInputHungUp() {
+	struct pollfd fd = { .fd = STDIN_FILENO, .events = POLLIN };
+	return poll(&fd, 1, 0) == 1 && (fd.revents & (POLLHUP | POLLERR | POLLNVAL));
+}
+
+/*
+ * a server child waits on its client's socket along with the terminal. the
+ * client never writes after its request, so the socket turning readable
+ * means it is gone, and the child exits before taking keys meant for the
+ * shell the terminal went back to.
+ */
+void editorWaitForClient() {
+	if (!config.client) return;
+	struct pollfd fds[2] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = config.client, .events = POLLIN }
+	};
+	while (poll(fds, 2, -1) == -1 && errno == EINTR);
+	if (fds[1].revents) exit(0);
+}
+
 // read character from terminal input
-int editorReadKey() {
+int editorReadTerminalKey() {
 	int nread;
 	char c;
+	editorWaitForClient();
 	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
 		if (nread == -1 && errno != EAGAIN) die("read");
+		if (nread == 0 && editorInputHungUp()) {
+			errno = EIO;
+			die("read");
+		}
+		editorWaitForClient();
 	}
 
 	if (c == '\x1b') {
@@ -208,8 +815,33 @@ int editorReadKey() {
 	
 		return '\x1b';
 	} else {
-		return c;
+		// bytes of UTF-8 sequences come through as 128-255
+		return (unsigned char) c;
+	}
+}
+
+void editorMacroRecord(int key) {
+	if (macro.len == macro.cap) {
+		macro.cap = macro.cap ? macro.cap * 2 : 64;
+		macro.keys = realloc(macro.keys, sizeof(int) * macro.cap);
+	}
+	macro.keys[macro.len++] = key;
+}
+
+int editorReadKey() {
+	// scripted keys win over the terminal
+	if (config.keys_pos < config.keys_len) {
+		int key = config.keys[config.keys_pos++];
+		if (config.keys_pos == config.keys_len) config.keys_pos = config.keys_len = 0;
+		return key;
 	}
+	// a drained script cancels whatever is still waiting for input
+	if (config.headless) return '\x1b';
+
+	// only keys typed by the user end up in a macro, never replayed ones
+	int c = editorReadTerminalKey();
+	if (macro.recording) editorMacroRecord(c);
+	return c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -250,19 +882,542 @@ int getWindowSize(int *rows, int *cols) {
 	}
 }
 
+/*** profiler ***/
+
+// returns 0 when profiling is off so spans cost a branch and nothing else
+long long profStart() {
+	if (!profile.enabled) return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// adds the time since start to the stage's total for this frame
+void profEnd(int stage, long long start) {
+	// spans opened before profiling was switched on are dropped
+	if (!profile.enabled || start == 0) return;
+	profile.frame[stage] += profStart() - start;
+}
+
+int profBucket(unsigned long long v) {
+	if (v < 4) return v;
+	int b = 63 - __builtin_clzll(v);
+	return (b - 1) * 4 + ((v >> (b - 2)) & 3);
+}
+
+unsigned long long profBucketFloor(int i) {
+	if (i < 4) return i;
+	return (4ULL + i % 4) << (i / 4 - 1);
+}
+
+// moves the per-frame totals into the histograms
+void profEndFrame(int bytes) {
+	if (!profile.enabled) return;
+	profile.frame[PROF_BYTES] = bytes;
+	for (int j = 0; j < PROF_STAGES; j++) {
+		profile.hist[j][profBucket(profile.frame[j])]++;
+		profile.frame[j] = 0;
+	}
+	profile.frames++;
+}
+
+unsigned long long profPercentile(int stage, double q) {
+	unsigned long long want = q * profile.frames, seen = 0;
+	for (int j = 0; j < PROF_BUCKETS; j++) {
+		seen += profile.hist[stage][j];
+		if (seen > want) return profBucketFloor(j);
+	}
+	return 0;
+}
+
+void profDump() {
+	FILE *fp = fopen(profile.dump, "w");
+	if (!fp) return;
+	fprintf(fp, "# frames %llu, times in ns\n", profile.frames);
+	fprintf(fp, "# stage p50 p90 p99\n");
+	for (int s = 0; s < PROF_STAGES; s++)
+		fprintf(fp, "%s %llu %llu %llu\n", PROF_NAMES[s], profPercentile(s, 0.5),
+			profPercentile(s, 0.9), profPercentile(s, 0.99));
+	fprintf(fp, "# stage bucket_floor count\n");
+	for (int s = 0; s < PROF_STAGES; s++)
+		for (int j = 0; j < PROF_BUCKETS; j++)
+			if (profile.hist[s][j])
+				fprintf(fp, "%s %llu %llu\n", PROF_NAMES[s], profBucketFloor(j), profile.hist[s][j]);
+	fclose(fp);
+}
+
+/*** memory ***/
+
+void memAccount(int kind, long long delta) {
+	memory.live[kind] += delta;
+	if (memory.live[kind] > memory.peak[kind]) memory.peak[kind] = memory.live[kind];
+}
+
+// realloc that charges the size change to kind
+void *memRealloc(int kind, void *p, size_t oldsize, size_t newsize) {
+	void *new = realloc(p, newsize);
+	if (new == NULL && newsize) return NULL;
+	memAccount(kind, (long long) newsize - (long long) oldsize);
+	return new;
+}
+
+void memFree(int kind, void *p, size_t size) {
+	if (p == NULL) return;
+	free(p);
+	memAccount(kind, -(long long) size);
+}
+
+int memHuman(char *buf, size_t len, long long bytes) {
+	if (bytes < 1024) return snprintf(buf, len, "%lld", bytes);
+	if (bytes < 1024 * 1024) return snprintf(buf, len, "%.1fK", bytes / 1024.0);
+	if (bytes < 1024LL * 1024 * 1024) return snprintf(buf, len, "%.1fM", bytes / 1048576.0);
+	return snprintf(buf, len, "%.1fG", bytes / 1073741824.0);
+}
+
+long long memLive() {
+	long long total = 0;
+	for (int k = 0; k < MEM_KINDS; k++) total += memory.live[k];
+	return total;
+}
+
+// one "kind live peak" line per category, then the total
+void memDump() {
+	FILE *fp = fopen(memory.dump, "w");
+	if (!fp) return;
+	long long total = 0;
+	for (int k = 0; k < MEM_KINDS; k++) {
+		fprintf(fp, "%s %lld %lld\n", MEM_NAMES[k], memory.live[k], memory.peak[k]);
+		total += memory.live[k];
+	}
+	fprintf(fp, "total %lld\n", total);
+	fclose(fp);
+}
+
+/*** syntax definitions ***/
+
+uint32_t sdbHash(const char *s) {
+	uint32_t h = 2166136261u;
+	while (*s) h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+// growable byte buffer used while compiling
+struct sdbBuf {
+	char *b;
+	size_t len;
+	size_t cap;
+};
+
+uint32_t sdbPut(struct sdbBuf *buf, const void *p, size_t len) {
+	uint32_t off = buf->len;
+	if (buf->len + len > buf->cap) {
+		while (buf->len + len > buf->cap) buf->cap = buf->cap ? buf->cap * 2 : 4096;
+		buf->b = realloc(buf->b, buf->cap);
+	}
+	if (p) memcpy(&buf->b[buf->len], p, len);
+	else memset(&buf->b[buf->len], 0, len);
+	buf->len += len;
+	return off;
+}
+
+uint32_t sdbString(struct sdbBuf *pool, const char *s) {
+	if (s == NULL || *s == '\0') return 0;
+	return sdbPut(pool, s, strlen(s) + 1);
+}
+
+char *sdbDir(char *buf, size_t len) {
+	char *dir = getenv("KILO_SYNTAX_DIR");
+	if (dir) {
+		snprintf(buf, len, "%s", dir);
+	} else {
+		char *home = getenv("HOME");
+		if (!home) return NULL;
+		snprintf(buf, len, "%s/.kilo/syntax", home);
+	}
+	return buf;
+}
+
+int sdbIsDefinition(const char *name) {
+	size_t len = strlen(name);
+	return len > 7 && !strcmp(&name[len - 7], ".syntax");
+}
+
+// cheap fingerprint of the definition files: names, sizes and mtimes
+uint64_t sdbSignature(const char *dir) {
+	uint64_t sig = SDB_VERSION + HLDB_ENTRIES * 0x100000001ULL;
+	char path[512];
+	struct dirent *ent;
+	struct stat st;
+	DIR *d = dir ? opendir(dir) : NULL;
+	if (!d) return sig;
+	while ((ent = readdir(d))) {
+		if (!sdbIsDefinition(ent->d_name)) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (stat(path, &st) == -1) continue;
+		// order independent so readdir order does not matter
+		sig += editorHashBytes(ent->d_name, strlen(ent->d_name)) ^
+		       (uint64_t) st.st_size * 0x9e3779b97f4a7c15ULL ^
+		       ((uint64_t) st.st_mtim.tv_sec << 20) ^ st.st_mtim.tv_nsec;
+	}
+	closedir(d);
+	return sig;
+}
+
+// appends a word to a NULL terminated list
+char **sdbListAdd(char **list, int *count, const char *word) {
+	list = realloc(list, sizeof(char *) * (*count + 2));
+	list[(*count)++] = strdup(word);
+	list[*count] = NULL;
+	return list;
+}
+
+/*
+ * parses one definition file. each line is a directive:
+ *   filetype NAME        starts a new syntax
+ *   filematch PAT...     ".ext" matches the extension, anything else a substring
+ *   keywords WORD...     a trailing | marks a secondary (type) keyword
+ *   comment START
+ *   multiline START END
+ *   flags numbers strings
+ */
+int sdbParseFile(const char *path, struct editorSyntax **list, int *count) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) return -1;
+	char *line = NULL;
+	size_t linecap = 0;
+	int nmatch = 0, nkw = 0;
+	struct editorSyntax *s = NULL;
+
+	while (getline(&line, &linecap, fp) != -1) {
+		char *save = NULL;
+		char *word = strtok_r(line, " \t\r\n", &save);
+		if (!word || word[0] == '#') continue;
+
+		if (!strcmp(word, "filetype")) {
+			char *name = strtok_r(NULL, " \t\r\n", &save);
+			if (!name) continue;
+			*list = realloc(*list, sizeof(struct editorSyntax) * (*count + 1));
+			s = &(*list)[(*count)++];
+			memset(s, 0, sizeof(*s));
+			s->filetype = strdup(name);
+			s->filematch = calloc(1, sizeof(char *));
+			s->keywords = calloc(1, sizeof(char *));
+			nmatch = nkw = 0;
+			continue;
+		}
+		if (!s) continue;
+
+		char *arg;
+		if (!strcmp(word, "filematch")) {
+			while ((arg = strtok_r(NULL, " \t\r\n", &save)))
+				s->filematch = sdbListAdd(s->filematch, &nmatch, arg);
+		} else if (!strcmp(word, "keywords")) {
+			while ((arg = strtok_r(NULL, " \t\r\n", &save)))
+				s->keywords = sdbListAdd(s->keywords, &nkw, arg);
+		} else if (!strcmp(word, "comment")) {
+			if ((arg = strtok_r(NULL, " \t\r\n", &save))) s->singleline_comment_start = strdup(arg);
+		} else if (!strcmp(word, "multiline")) {
+			char *end;
+			if ((arg = strtok_r(NULL, " \t\r\n", &save)) && (end = strtok_r(NULL, " \t\r\n", &save))) {
+				s->multiline_comment_start = strdup(arg);
+				s->multiline_comment_end = strdup(end);
+			}
+		} else if (!strcmp(word, "flags")) {
+			while ((arg = strtok_r(NULL, " \t\r\n", &save))) {
+				if (!strcmp(arg, "numbers")) s->flags |= HL_HIGHLIGHT_NUMBERS;
+				else if (!strcmp(arg, "strings")) s->flags |= HL_HIGHLIGHT_STRINGS;
+			}
+		}
+	}
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
+void sdbFreeParsed(struct editorSyntax *list, int count) {
+	for (int j = 0; j < count; j++) {
+		char **w;
+		for (w = list[j].filematch; *w; w++) free(*w);
+		for (w = list[j].keywords; *w; w++) free(*w);
+		free(list[j].filematch);
+		free(list[j].keywords);
+		free(list[j].filetype);
+		free(list[j].singleline_comment_start);
+		free(list[j].multiline_comment_start);
+		free(list[j].multiline_comment_end);
+	}
+	free(list);
+}
+
+// lays out syntaxes as a relocatable image; earlier entries win extension clashes
+char *sdbCompile(struct editorSyntax *list, int count, uint64_t signature, size_t *len) {
+	struct sdbBuf pool = { NULL, 0, 0 }, strtab = { NULL, 0, 0 };
+	struct sdbSyntax *syn = calloc(count ? count : 1, sizeof(struct sdbSyntax));
+	struct sdbMatch *patterns = NULL;
+	int npatterns = 0, nexts = 0, j, i;
+
+	sdbPut(&pool, "", 1);
+	for (j = 0; j < count; j++) {
+		struct editorSyntax *s = &list[j];
+		syn[j].filetype = sdbString(&pool, s->filetype);
+		syn[j].scs = sdbString(&pool, s->singleline_comment_start);
+		syn[j].mcs = sdbString(&pool, s->multiline_comment_start);
+		syn[j].mce = sdbString(&pool, s->multiline_comment_end);
+		syn[j].flags = s->flags;
+
+		syn[j].filematch = strtab.len / sizeof(uint32_t);
+		for (i = 0; s->filematch[i]; i++) {
+			uint32_t str = sdbString(&pool, s->filematch[i]);
+			sdbPut(&strtab, &str, sizeof(str));
+			if (s->filematch[i][0] == '.') {
+				nexts++;
+			} else {
+				patterns = realloc(patterns, sizeof(struct sdbMatch) * (npatterns + 1));
+				patterns[npatterns].hash = 0;
+				patterns[npatterns].str = str;
+				patterns[npatterns++].syntax = j + 1;
+			}
+		}
+		syn[j].nfilematch = i;
+
+		// bucket keywords by their first byte
+		int nkw = 0, c;
+		while (s->keywords[nkw]) nkw++;
+		syn[j].keywords = strtab.len / sizeof(uint32_t);
+		syn[j].nkeywords = nkw;
+		for (c = 0; c < 256; c++) {
+			syn[j].kwindex[c] = strtab.len / sizeof(uint32_t) - syn[j].keywords;
+			for (i = 0; i < nkw; i++) {
+				if ((unsigned char) s->keywords[i][0] != c) continue;
+				uint32_t str = sdbString(&pool, s->keywords[i]);
+				sdbPut(&strtab, &str, sizeof(str));
+			}
+		}
+		syn[j].kwindex[256] = nkw;
+	}
+
+	// open addressed extension table, at most half full
+	uint32_t slots = 16;
+	while (slots < (uint32_t) nexts * 2) slots *= 2;
+	struct sdbMatch *exts = calloc(slots, sizeof(struct sdbMatch));
+	for (j = 0; j < count; j++) {
+		for (i = 0; list[j].filematch[i]; i++) {
+			const char *ext = list[j].filematch[i];
+			if (ext[0] != '.') continue;
+			uint32_t h = sdbHash(ext), k = h & (slots - 1);
+			int taken = 0;
+			while (exts[k].syntax) {
+				if (exts[k].hash == h && !strcmp(&pool.b[exts[k].str], ext)) taken = 1;
+				if (taken) break;
+				k = (k + 1) & (slots - 1);
+			}
+			if (taken) continue;
+			exts[k].hash = h;
+			exts[k].str = ((uint32_t *) strtab.b)[syn[j].filematch + i];
+			exts[k].syntax = j + 1;
+		}
+	}
+
+	struct sdbBuf img = { NULL, 0, 0 };
+	struct sdbHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	sdbPut(&img, NULL, sizeof(hdr));
+	hdr.syntax_off = sdbPut(&img, syn, sizeof(struct sdbSyntax) * count);
+	hdr.strtab_off = sdbPut(&img, strtab.b, strtab.len);
+	hdr.ext_off = sdbPut(&img, exts, sizeof(struct sdbMatch) * slots);
+	hdr.pattern_off = sdbPut(&img, patterns, sizeof(struct sdbMatch) * npatterns);
+	hdr.pool_off = sdbPut(&img, pool.b, pool.len);
+	memcpy(hdr.magic, SDB_MAGIC, 4);
+	hdr.version = SDB_VERSION;
+	hdr.signature = signature;
+	hdr.size = img.len;
+	hdr.nsyntax = count;
+	hdr.ext_slots = slots;
+	hdr.npatterns = npatterns;
+	memcpy(img.b, &hdr, sizeof(hdr));
+
+	free(pool.b);
+	free(strtab.b);
+	free(syn);
+	free(patterns);
+	free(exts);
+	*len = img.len;
+	return img.b;
+}
+
+// whether count elements of size bytes at off lie within the image, aligned for their fields
+int sdbFits(size_t len, uint32_t off, uint32_t count, size_t size) {
+	return off % sizeof(uint32_t) == 0 && off <= len && count <= (len - off) / size;
+}
+
+/*
+ * the cache is read in place, so everything lookups follow is checked
+ * once here: every table lies within the image, string table ranges and
+ * keyword buckets within the table, and every string within the pool,
+ * which ends in a NUL so none runs past it
+ */
+int sdbValid(const char *image, size_t len, uint64_t signature) {
+	const struct sdbHeader *hdr = (const struct sdbHeader *) image;
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, SDB_MAGIC, 4) ||
+	    hdr->version != SDB_VERSION || hdr->signature != signature || hdr->size != len)
+		return 0;
+	if (hdr->pool_off >= len || image[len - 1] != '\0' || hdr->strtab_off > hdr->ext_off ||
+	    hdr->ext_slots == 0 || (hdr->ext_slots & (hdr->ext_slots - 1)) ||
+	    !sdbFits(len, hdr->syntax_off, hdr->nsyntax, sizeof(struct sdbSyntax)) ||
+	    !sdbFits(len, hdr->strtab_off, (hdr->ext_off - hdr->strtab_off) / sizeof(uint32_t), sizeof(uint32_t)) ||
+	    !sdbFits(len, hdr->ext_off, hdr->ext_slots, sizeof(struct sdbMatch)) ||
+	    !sdbFits(len, hdr->pattern_off, hdr->npatterns, sizeof(struct sdbMatch)))
+		return 0;
+
+	uint32_t pool = len - hdr->pool_off, nstr = (hdr->ext_off - hdr->strtab_off) / sizeof(uint32_t), j;
+	const uint32_t *strtab = (const uint32_t *) &image[hdr->strtab_off];
+	for (j = 0; j < nstr; j++)
+		if (strtab[j] >= pool) return 0;
+	const struct sdbSyntax *syn = (const struct sdbSyntax *) &image[hdr->syntax_off];
+	for (j = 0; j < hdr->nsyntax; j++) {
+		const struct sdbSyntax *d = &syn[j];
+		if (d->filetype >= pool || d->scs >= pool || d->mcs >= pool || d->mce >= pool ||
+		    d->filematch > nstr || d->nfilematch > nstr - d->filematch ||
+		    d->keywords > nstr || d->nkeywords > nstr - d->keywords ||
+		    d->kwindex[0] != 0 || d->kwindex[256] != d->nkeywords)
+			return 0;
+		for (int c = 0; c < 256; c++)
+			if (d->kwindex[c] > d->kwindex[c + 1]) return 0;
+	}
+	const struct sdbMatch *m = (const struct sdbMatch *) &image[hdr->ext_off];
+	for (j = 0; j < hdr->ext_slots; j++)
+		if (m[j].syntax && (m[j].syntax > hdr->nsyntax || m[j].str >= pool)) return 0;
+	// a table with no free slot would never end a probe
+	for (j = 0; j < hdr->ext_slots && m[j].syntax; j++);
+	if (j == hdr->ext_slots) return 0;
+	m = (const struct sdbMatch *) &image[hdr->pattern_off];
+	for (j = 0; j < hdr->npatterns; j++)
+		if (m[j].syntax == 0 || m[j].syntax > hdr->nsyntax || m[j].str >= pool) return 0;
+	return 1;
+}
+
+// maps the cached image if it is current, otherwise recompiles and rewrites it
+void editorLoadSyntaxDB() {
+	char dirbuf[256], path[512];
+	char *dir = sdbDir(dirbuf, sizeof(dirbuf));
+	uint64_t signature = sdbSignature(dir);
+
+	if (dir) {
+		snprintf(path, sizeof(path), "%s/%s", dir, SDB_CACHE);
+		int fd = open(path, O_RDONLY);
+		struct stat st;
+		if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct sdbHeader)) {
+			char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (image != MAP_FAILED && sdbValid(image, st.st_size, signature)) {
+				sdb.image = image;
+				sdb.len = st.st_size;
+				sdb.mapped = 1;
+			} else if (image != MAP_FAILED) {
+				munmap(image, st.st_size);
+			}
+		}
+		if (fd != -1) close(fd);
+	}
+
+	if (!sdb.image) {
+		// user definitions first so they can take over built-in extensions
+		struct editorSyntax *list = NULL;
+		int count = 0;
+		DIR *d = dir ? opendir(dir) : NULL;
+		struct dirent *ent;
+		while (d && (ent = readdir(d))) {
+			if (!sdbIsDefinition(ent->d_name)) continue;
+			snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+			sdbParseFile(path, &list, &count);
+		}
+		if (d) closedir(d);
+		list = realloc(list, sizeof(struct editorSyntax) * (count + HLDB_ENTRIES));
+		memcpy(&list[count], HLDB, sizeof(HLDB));
+		sdb.image = sdbCompile(list, count + HLDB_ENTRIES, signature, &sdb.len);
+		sdbFreeParsed(list, count);
+
+		if (d) {
+			// write then rename so a concurrent reader never maps half a file
+			char tmp[530];
+			snprintf(path, sizeof(path), "%s/%s", dir, SDB_CACHE);
+			snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+			int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd != -1) {
+				int ok = write(fd, sdb.image, sdb.len) == (ssize_t) sdb.len;
+				close(fd);
+				if (!ok || rename(tmp, path) == -1) unlink(tmp);
+			}
+		}
+	}
+
+	sdb.hdr = (struct sdbHeader *) sdb.image;
+	sdb.syntax = calloc(sdb.hdr->nsyntax + 1, sizeof(struct editorSyntax));
+	sdb.ready = calloc(sdb.hdr->nsyntax + 1, 1);
+}
+
+// builds the struct editorSyntax view of entry idx, pointing into the image
+struct editorSyntax *sdbSyntax(int idx) {
+	struct editorSyntax *s = &sdb.syntax[idx];
+	if (sdb.ready[idx]) return s;
+
+	struct sdbSyntax *d = (struct sdbSyntax *) &sdb.image[sdb.hdr->syntax_off] + idx;
+	uint32_t *strtab = (uint32_t *) &sdb.image[sdb.hdr->strtab_off];
+	char *pool = &sdb.image[sdb.hdr->pool_off];
+	uint32_t j;
+
+	s->filetype = &pool[d->filetype];
+	s->singleline_comment_start = d->scs ? &pool[d->scs] : NULL;
+	s->multiline_comment_start = d->mcs ? &pool[d->mcs] : NULL;
+	s->multiline_comment_end = d->mce ? &pool[d->mce] : NULL;
+	s->flags = d->flags;
+	s->filematch = malloc(sizeof(char *) * (d->nfilematch + 1));
+	for (j = 0; j < d->nfilematch; j++) s->filematch[j] = &pool[strtab[d->filematch + j]];
+	s->filematch[j] = NULL;
+	s->keywords = malloc(sizeof(char *) * (d->nkeywords + 1));
+	for (j = 0; j < d->nkeywords; j++) s->keywords[j] = &pool[strtab[d->keywords + j]];
+	s->keywords[j] = NULL;
+	s->kwindex = d->kwindex;
+	sdb.ready[idx] = 1;
+	return s;
+}
+
+// one hash probe for the extension, then the (usually empty) substring patterns
+struct editorSyntax *sdbMatchFile(const char *filename) {
+	if (!sdb.image) editorLoadSyntaxDB();
+	char *pool = &sdb.image[sdb.hdr->pool_off];
+	char *ext = strrchr(filename, '.');
+
+	if (ext) {
+		struct sdbMatch *exts = (struct sdbMatch *) &sdb.image[sdb.hdr->ext_off];
+		uint32_t mask = sdb.hdr->ext_slots - 1;
+		uint32_t h = sdbHash(ext), k = h & mask;
+		while (exts[k].syntax) {
+			if (exts[k].hash == h && !strcmp(&pool[exts[k].str], ext))
+				return sdbSyntax(exts[k].syntax - 1);
+			k = (k + 1) & mask;
+		}
+	}
+
+	struct sdbMatch *patterns = (struct sdbMatch *) &sdb.image[sdb.hdr->pattern_off];
+	for (uint32_t j = 0; j < sdb.hdr->npatterns; j++)
+		if (strstr(filename, &pool[patterns[j].str])) return sdbSyntax(patterns[j].syntax - 1);
+	return NULL;
+}
+
 /*** syntax highlighting ***/
 
 int is_seperator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+	return isspace((unsigned char) c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
-
-	if (config.syntax == NULL) return;
+// runs the highlighter over a row that starts inside a block comment or
+// not. fills hl when given and returns whether a comment is open at the end
+int editorHighlightRow(erow *row, int in_comment, unsigned char *hl) {
+	if (hl) memset(hl, HL_NORMAL, row->rsize);
+	if (config.syntax == NULL) return 0;
 
 	char **keywords = config.syntax->keywords;
+	uint16_t *kwindex = config.syntax->kwindex;
 
 	char *scs = config.syntax->singleline_comment_start;
 	char *mcs = config.syntax->multiline_comment_start;
@@ -274,17 +1429,18 @@ void editorUpdateSyntax(erow *row) {
 
 	int prev_sep = 1;
 	int in_string = 0;
-	int in_comment = (row->idx > 0 && config.row[row->idx -1].hl_open_comment);
+	// tracked here rather than read back from hl, which may be NULL
+	int number_end = -1;
 
 	int i = 0;
 	while (i < row->rsize) {
 		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+		int prev_number = (number_end == i);
 
 		// Single Line comment Highlighting
 		if (scs_len && !in_string && !in_comment) {
 			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+				if (hl) memset(&hl[i], HL_COMMENT, row->rsize - i);
 				break;
 			}
 		}
@@ -292,9 +1448,9 @@ void editorUpdateSyntax(erow *row) {
 		// Multiline Comment Highlighting
 		if (mcs_len && mce_len && !in_string) {
 			if (in_comment) {
-				row->hl[i] = HL_MLCOMMENT;
+				if (hl) hl[i] = HL_MLCOMMENT;
 				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+					if (hl) memset(&hl[i], HL_MLCOMMENT, mce_len);
 					i += mce_len;
 					in_comment = 0;
 					prev_sep = 1;
@@ -304,7 +1460,7 @@ void editorUpdateSyntax(erow *row) {
 					continue;
 				}
 			} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+				if (hl) memset(&hl[i], HL_MLCOMMENT, mcs_len);
 				i += mcs_len;
 				in_comment = 1;
 				continue;
@@ -314,9 +1470,9 @@ void editorUpdateSyntax(erow *row) {
 		// String Highlighting
 		if (config.syntax->flags & HL_HIGHLIGHT_STRINGS) {
 			if (in_string) {
-				row->hl[i] = HL_STRING;
+				if (hl) hl[i] = HL_STRING;
 				if (c == '\\' && i + 1 < row->rsize) {
-					row->hl[i + 1] = HL_STRING;
+					if (hl) hl[i + 1] = HL_STRING;
 					i += 2;
 					continue;
 				}
@@ -327,7 +1483,7 @@ void editorUpdateSyntax(erow *row) {
 			} else {
 				if (c == '"' || c == '\'') {
 					in_string = c;
-					row->hl[i] = HL_STRING;
+					if (hl) hl[i] = HL_STRING;
 					i++;
 					continue;
 				}
@@ -336,31 +1492,33 @@ void editorUpdateSyntax(erow *row) {
 		
 		// Number Highlighting
 		if (config.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-							   (c == '.' && prev_hl == HL_NUMBER)) {
-				row->hl[i] = HL_NUMBER;
+			if ((isdigit((unsigned char) c) && (prev_sep || prev_number)) ||
+							   (c == '.' && prev_number)) {
+				if (hl) hl[i] = HL_NUMBER;
 				i++;
+				number_end = i;
 				prev_sep = 0;
 				continue;
 			}
 		}
 
-		// Keyword highlighting
+		// Keyword highlighting, only keywords sharing the first byte are tried
 		if (prev_sep) {
-			int j = 0;
-			for (j = 0; keywords[j]; j++) {
+			int j = kwindex[(unsigned char) c];
+			int end = kwindex[(unsigned char) c + 1];
+			for (; j < end; j++) {
 				int klen = strlen(keywords[j]);
 				int kw2 = keywords[j][klen - 1] == '|';
 				if (kw2) klen--;
 
 				if (!strncmp(&row->render[i], keywords[j], klen) &&
 				    is_seperator(row->render[i + klen])) {
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+					if (hl) memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
 					i += klen;
 					break;
 				}
 			}
-			if (keywords[j] != NULL) {
+			if (j < end) {
 				prev_sep = 0;
 				continue;
 			}
@@ -370,10 +1528,126 @@ void editorUpdateSyntax(erow *row) {
 		i++;
 	}
 
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < config.numrows)
-		editorUpdateSyntax(&config.row[row->idx + 1]);
+	return in_comment;
+}
+
+// rows from "at" on may now end in a different comment state
+void editorSyntaxInvalidate(int at, int edited) {
+	if (at < config.hl_valid) config.hl_valid = at;
+	if (edited > config.hl_dirty) config.hl_dirty = edited;
+	config.hl_version = ++highlighter.version;
+}
+
+/*
+ * extends hl_valid by up to budget rows. once it reaches a row past every
+ * edit whose state did not change, the rest of the file is known unchanged.
+ */
+void editorSyntaxAdvance(int budget) {
+	if (config.hl_pending) editorSyntaxFlush();
+	while (config.hl_valid < config.numrows && budget-- > 0) {
+		int i = config.hl_valid;
+		int in = i ? config.hl_state[i - 1] : 0;
+		int out = (config.hl_trans[i] >> in) & 1;
+		int settled = (i >= config.hl_dirty && out == config.hl_state[i]);
+		if (out != config.hl_state[i]) {
+			config.hl_state[i] = out;
+			// the next row's bracket summary is picked by this state
+			editorBracketsSet(i + 1);
+		}
+		config.hl_valid = settled ? config.numrows : i + 1;
+	}
+	if (config.hl_valid >= config.numrows) config.hl_dirty = 0;
+}
+
+// recomputes the row's comment transitions; its hl is rebuilt when drawn
+void editorUpdateSyntax(erow *row) {
+	if (config.hl_defer) {
+		// anything above 3 is not a transition and gets computed on flush
+		config.hl_trans[row->idx] = 0xfe;
+		config.hl_pending = 1;
+		editorSyntaxInvalidate(row->idx, row->idx + 1);
+		return;
+	}
+
+	long long prof = profStart();
+	int trans = 2;
+
+	if (config.syntax && config.syntax->multiline_comment_start &&
+	    config.syntax->multiline_comment_end) {
+		char *mcs = config.syntax->multiline_comment_start;
+		char *mce = config.syntax->multiline_comment_end;
+		// packed rows are scanned in place, a syntax change visits every row
+		erow view = *row;
+		view.render = editorRowRender(row, &view.rsize);
+		// rows without the delimiters cannot change state, skip the scans
+		int out0 = memmem(view.render, view.rsize, mcs, strlen(mcs)) ?
+			editorHighlightRow(&view, 0, NULL) : 0;
+		int out1 = memmem(view.render, view.rsize, mce, strlen(mce)) ?
+			editorHighlightRow(&view, 1, NULL) : 1;
+		trans = out0 | (out1 << 1);
+	}
+	if (config.hl_trans[row->idx] != trans) {
+		config.hl_trans[row->idx] = trans;
+		editorSyntaxInvalidate(row->idx, row->idx + 1);
+	}
+	profEnd(PROF_SYNTAX, prof);
+}
+
+// computes every transition marked while updates were deferred
+void editorSyntaxFlush() {
+	int defer = config.hl_defer, j;
+	config.hl_defer = 0;
+	config.hl_pending = 0;
+	for (j = config.hl_valid; j < config.numrows; j++)
+		if (config.hl_trans[j] > 3) editorUpdateSyntax(&config.row[j]);
+	config.hl_defer = defer;
+}
+
+// highlights a row for the comment state it actually starts in
+void editorRowEnsureSyntax(erow *row) {
+	int at = row->idx;
+	editorRowThaw(row);
+	if (config.hl_pending) editorSyntaxFlush();
+	if (at > config.hl_valid) editorSyntaxAdvance(at - config.hl_valid);
+	int in = at ? config.hl_state[at - 1] : 0;
+	if (row->hl_in == in) return;
+
+	long long prof = profStart();
+	if (row->hl_in == -1) row->hl = memRealloc(MEM_HL, NULL, 0, row->rsize);
+	editorHighlightRow(row, in, row->hl);
+	row->hl_in = in;
+	profEnd(PROF_SYNTAX, prof);
+}
+
+// keeps the per-row state arrays the same length as config.row
+void editorSyntaxResize(int oldcap, int cap) {
+	if (cap == 0) {
+		memFree(MEM_SYNTAX, config.hl_trans, oldcap);
+		memFree(MEM_SYNTAX, config.hl_state, oldcap);
+		config.hl_trans = config.hl_state = NULL;
+		return;
+	}
+	config.hl_trans = memRealloc(MEM_SYNTAX, config.hl_trans, oldcap, cap);
+	config.hl_state = memRealloc(MEM_SYNTAX, config.hl_state, oldcap, cap);
+}
+
+void editorSyntaxInsert(int at) {
+	memmove(&config.hl_trans[at + 1], &config.hl_trans[at], config.numrows - at);
+	memmove(&config.hl_state[at + 1], &config.hl_state[at], config.numrows - at);
+	// never a valid transition, so the first update always registers
+	config.hl_trans[at] = 0xff;
+	// passing the state through keeps the bracket leaf of the next row current
+	config.hl_state[at] = at ? config.hl_state[at - 1] : 0;
+	if (config.hl_dirty > at) config.hl_dirty++;
+	editorSyntaxInvalidate(at, at + 1);
+}
+
+void editorSyntaxDelete(int at) {
+	memmove(&config.hl_trans[at], &config.hl_trans[at + 1], config.numrows - at - 1);
+	memmove(&config.hl_state[at], &config.hl_state[at + 1], config.numrows - at - 1);
+	if (config.hl_dirty > at) config.hl_dirty--;
+	editorBracketsSet(at);
+	editorSyntaxInvalidate(at, at);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -400,34 +1674,1286 @@ void editorSelectSyntaxHighlight() {
 	config.syntax = NULL;
 	if (config.filename == NULL) return;
 
-	char *ext = strrchr(config.filename, '.');
+	config.syntax = sdbMatchFile(config.filename);
 
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i]) {
-			int is_ext = (s->filematch[i][0] == '.');
-			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-			    (!is_ext && strstr(config.filename, s->filematch[i]))) {
-				config.syntax = s;
+	// every transition and every highlighted row is out of date
+	int filerow;
+	for (filerow = 0; filerow < config.numrows; filerow++) {
+		editorUpdateSyntax(&config.row[filerow]);
+		if (config.row[filerow].hl_in != -1) config.row[filerow].hl_in = -2;
+		// bracket summaries skip strings and comments, which the syntax decides
+		if (config.row[filerow].brk_valid) brackets.pending++;
+		config.row[filerow].brk_valid = 0;
+	}
+	if (config.numrows) brackets.active = 0;
+	editorSyntaxInvalidate(0, config.numrows);
+}
 
-				int filerow;
-				for (filerow = 0; filerow < config.numrows; filerow++) {
-					editorUpdateSyntax(&config.row[filerow]);
-				}
+/*** highlighter thread ***/
 
-				return;
+void *editorHighlighterMain(void *arg) {
+	(void) arg;
+#ifdef SCHED_IDLE
+	struct sched_param sp = { 0 };
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+
+	pthread_mutex_lock(&highlighter.lock);
+	while (1) {
+		while (!highlighter.pending) pthread_cond_wait(&highlighter.wake, &highlighter.lock);
+		struct hlJob *job = highlighter.pending;
+		highlighter.pending = NULL;
+		pthread_mutex_unlock(&highlighter.lock);
+
+		int in = job->in, j;
+		for (j = 0; j < job->count; j++) {
+			in = (job->trans[j] >> in) & 1;
+			job->state[j] = in;
+			if (j >= job->converge && in == job->old[j]) {
+				job->converged = 1;
+				j++;
+				break;
 			}
-			i++;
 		}
+		job->done = j;
+
+		// the slot is always empty: the UI only submits again once it has
+		// collected this job and cleared busy itself
+		__atomic_store_n(&highlighter.result, job, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&highlighter.lock);
 	}
+	return NULL;
 }
 
-/*** row operations ***/
+void editorFreeJob(struct hlJob *job) {
+	memFree(MEM_SYNTAX, job->trans, job->count);
+	memFree(MEM_SYNTAX, job->old, job->count);
+	memFree(MEM_SYNTAX, job->state, job->count);
+	memFree(MEM_SYNTAX, job, sizeof(*job));
+}
+
+// called once per frame: applies finished work and queues the remaining states
+void editorSyntaxSchedule() {
+	struct hlJob *job = __atomic_exchange_n(&highlighter.result, NULL, __ATOMIC_ACQ_REL);
+	if (job) {
+		// anything edited since the snapshot makes the result worthless
+		if (job->version == config.hl_version && job->start <= config.hl_valid) {
+			for (int j = 0; j < job->done; j++) {
+				if (config.hl_state[job->start + j] == job->state[j]) continue;
+				config.hl_state[job->start + j] = job->state[j];
+				editorBracketsSet(job->start + j + 1);
+			}
+			int valid = job->converged ? config.numrows : job->start + job->done;
+			if (valid > config.hl_valid) config.hl_valid = valid;
+			if (config.hl_valid >= config.numrows) config.hl_dirty = 0;
+		}
+		editorFreeJob(job);
+		__atomic_store_n(&highlighter.busy, 0, __ATOMIC_RELEASE);
+	}
+
+	editorSyntaxAdvance(HL_SYNC_BUDGET);
+	if (config.hl_valid >= config.numrows) return;
+	if (__atomic_load_n(&highlighter.busy, __ATOMIC_ACQUIRE)) return;
+
+	if (highlighter.pid != getpid()) {
+		if (pthread_create(&highlighter.thread, NULL, editorHighlighterMain, NULL) != 0) return;
+		pthread_detach(highlighter.thread);
+		highlighter.pid = getpid();
+	}
+
+	int start = config.hl_valid, count = config.numrows - start;
+	job = memRealloc(MEM_SYNTAX, NULL, 0, sizeof(*job));
+	job->version = config.hl_version;
+	job->start = start;
+	job->count = count;
+	job->converge = config.hl_dirty > start ? config.hl_dirty - start : 0;
+	job->in = start ? config.hl_state[start - 1] : 0;
+	job->trans = memRealloc(MEM_SYNTAX, NULL, 0, count);
+	job->old = memRealloc(MEM_SYNTAX, NULL, 0, count);
+	job->state = memRealloc(MEM_SYNTAX, NULL, 0, count);
+	memcpy(job->trans, &config.hl_trans[start], count);
+	memcpy(job->old, &config.hl_state[start], count);
+	job->done = 0;
+	job->converged = 0;
+
+	__atomic_store_n(&highlighter.busy, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&highlighter.lock);
+	highlighter.pending = job;
+	pthread_cond_signal(&highlighter.wake);
+	pthread_mutex_unlock(&highlighter.lock);
+}
+
+/*** prefix sums ***/
+
+// rows after stale are summed directly up to this many before rebuilding
+#define FENWICK_SCAN 1024
+
+void fenwickInvalidate(struct fenwick *f, int at) {
+	if (at < f->stale) f->stale = at;
+}
+
+// sum of the first n rows, n must not be past stale
+long long fenwickPrefix(struct fenwick *f, int n) {
+	long long sum = 0;
+	for (; n > 0; n -= n & -n) sum += f->tree[n];
+	return sum;
+}
+
+// applies a changed row in place if the tree is still exact for it
+void fenwickUpdate(struct fenwick *f, erow *row) {
+	int i = row->idx + 1;
+	if (row->idx >= f->stale) return;
+	long long delta = f->value(row) - (fenwickPrefix(f, i) - fenwickPrefix(f, i - 1));
+	// entries past stale get recomputed anyway
+	for (; i <= f->stale; i += i & -i) f->tree[i] += delta;
+}
+
+// recomputes the entries from stale on, amortized O(1) per row
+void fenwickRebuild(struct fenwick *f) {
+	int n = config.numrows, i;
+	if (n + 1 > f->cap) {
+		int cap = f->cap ? f->cap : 16;
+		while (cap < n + 1) cap *= 2;
+		f->tree = memRealloc(MEM_INDEX, f->tree, sizeof(long long) * f->cap,
+			sizeof(long long) * cap);
+		f->cap = cap;
+	}
+	for (i = f->stale + 1; i <= n; i++) {
+		long long sum = f->value(&config.row[i - 1]);
+		for (int step = 1; step < (i & -i); step <<= 1) sum += f->tree[i - step];
+		f->tree[i] = sum;
+	}
+	f->stale = n;
+}
+
+// sum of the first n rows
+long long fenwickSum(struct fenwick *f, int n) {
+	if (n > f->stale + FENWICK_SCAN) fenwickRebuild(f);
+	if (n <= f->stale) return fenwickPrefix(f, n);
+	// just past an edit, cheaper than rebuilding the rest of the file
+	long long sum = fenwickPrefix(f, f->stale);
+	for (int j = f->stale; j < n; j++) sum += f->value(&config.row[j]);
+	return sum;
+}
+
+/*
+ * finds the row containing position pos, i.e. the last row whose prefix
+ * sum is at most pos, and stores pos minus that sum in rem. returns numrows
+ * when pos is past the end.
+ */
+int fenwickFind(struct fenwick *f, long long pos, long long *rem) {
+	int at = 0, step = 1;
+	fenwickRebuild(f);
+	while (step * 2 <= config.numrows) step *= 2;
+	for (; step > 0; step >>= 1) {
+		if (at + step <= config.numrows && f->tree[at + step] <= pos) {
+			at += step;
+			pos -= f->tree[at];
+		}
+	}
+	*rem = pos;
+	return at;
+}
+
+void fenwickFree(struct fenwick *f) {
+	memFree(MEM_INDEX, f->tree, sizeof(long long) * f->cap);
+	f->tree = NULL;
+	f->cap = 0;
+	f->stale = 0;
+}
+
+/*** utf-8 ***/
+
+/*
+ * decodes the sequence at s, returning its length. a byte that does not
+ * start a valid sequence (stray, truncated, overlong or surrogate) is
+ * decoded on its own as -1.
+ */
+int editorUtf8Decode(const char *s, int len, int *cp) {
+	const unsigned char *u = (const unsigned char *) s;
+	int min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	int n, c;
+	*cp = -1;
+	if (u[0] < 0x80) {
+		*cp = u[0];
+		return 1;
+	} else if ((u[0] & 0xe0) == 0xc0) {
+		n = 2;
+		c = u[0] & 0x1f;
+	} else if ((u[0] & 0xf0) == 0xe0) {
+		n = 3;
+		c = u[0] & 0x0f;
+	} else if ((u[0] & 0xf8) == 0xf0) {
+		n = 4;
+		c = u[0] & 0x07;
+	} else {
+		return 1;
+	}
+	if (n > len) return 1;
+	for (int j = 1; j < n; j++) {
+		if ((u[j] & 0xc0) != 0x80) return 1;
+		c = (c << 6) | (u[j] & 0x3f);
+	}
+	if (c < min[n] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) return 1;
+	*cp = c;
+	return n;
+}
+
+// columns a character takes; controls and invalid bytes are drawn as one symbol
+int editorCharWidth(int cp) {
+	if (cp < CHAR_WIDTHS[0].first) return 1;
+	int lo = 0, hi = sizeof(CHAR_WIDTHS) / sizeof(CHAR_WIDTHS[0]) - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (cp < CHAR_WIDTHS[mid].first) hi = mid - 1;
+		else if (cp > CHAR_WIDTHS[mid].last) lo = mid + 1;
+		else return CHAR_WIDTHS[mid].width;
+	}
+	return 1;
+}
+
+// checks 16 bytes per step where SSE2 is available, 8 otherwise
+int editorIsAscii(const char *s, int len) {
+	int j = 0;
+#ifdef __SSE2__
+	for (; j + 16 <= len; j += 16)
+		if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) &s[j]))) return 0;
+#endif
+	uint64_t w;
+	for (; j + 8 <= len; j += 8) {
+		memcpy(&w, &s[j], 8);
+		if (w & 0x8080808080808080ULL) return 0;
+	}
+	for (; j < len; j++)
+		if (s[j] & 0x80) return 0;
+	return 1;
+}
+
+/*** cold storage ***/
+
+// one LZ sequence: a token, literals, then a back reference unless mlen is 0
+int coldSequence(char *dst, int o, const char *lit, int llen, int off, int mlen) {
+	unsigned char *token = (unsigned char *) &dst[o++];
+	int l = llen, m = mlen ? mlen - 4 : 0;
+	*token = (l < 15 ? l : 15) << 4 | (m < 15 ? m : 15);
+	if (l >= 15) {
+		for (l -= 15; l >= 255; l -= 255) dst[o++] = (char) 255;
+		dst[o++] = l;
+	}
+	memcpy(&dst[o], lit, llen);
+	o += llen;
+	if (mlen) {
+		dst[o++] = off & 0xff;
+		dst[o++] = off >> 8;
+		if (m >= 15) {
+			for (m -= 15; m >= 255; m -= 255) dst[o++] = (char) 255;
+			dst[o++] = m;
+		}
+	}
+	return o;
+}
+
+/*
+ * greedy LZ77 with a 4-byte hash and a 64K window, in the LZ4 sequence
+ * format. dst needs room for n + n / 255 + 16 bytes.
+ */
+int coldCompress(const char *src, int n, char *dst) {
+	int table[1 << COLD_HASH_BITS] = { 0 };
+	int i = 0, anchor = 0, o = 0;
+	while (i + 4 <= n) {
+		uint32_t v;
+		memcpy(&v, &src[i], 4);
+		int h = (v * 2654435761u) >> (32 - COLD_HASH_BITS);
+		// positions are stored plus one so 0 means empty
+		int ref = table[h] - 1;
+		table[h] = i + 1;
+		if (ref < 0 || i - ref > 65535 || memcmp(&src[ref], &src[i], 4)) {
+			i++;
+			continue;
+		}
+		int len = 4;
+		while (i + len < n && src[ref + len] == src[i + len]) len++;
+		o = coldSequence(dst, o, &src[anchor], i - anchor, i - ref, len);
+		i += len;
+		anchor = i;
+	}
+	return coldSequence(dst, o, &src[anchor], n - anchor, 0, 0);
+}
+
+void coldDecompress(const char *src, int len, char *dst, int rawlen) {
+	const unsigned char *s = (const unsigned char *) src, *end = s + len;
+	int o = 0;
+	while (s < end) {
+		int token = *s++;
+		int l = token >> 4, m = token & 15;
+		if (l == 15) do l += *s; while (*s++ == 255);
+		memcpy(&dst[o], s, l);
+		s += l;
+		o += l;
+		if (o >= rawlen) break;
+		int off = s[0] | s[1] << 8;
+		s += 2;
+		if (m == 15) do m += *s; while (*s++ == 255);
+		// matches may overlap their own output, so copy bytewise
+		for (m += 4; m > 0; m--, o++) dst[o] = dst[o - off];
+	}
+}
+
+void coldRelease(struct coldBlock *block) {
+	if (--block->refs > 0) return;
+	if (cold.cached == block) cold.cached = NULL;
+	memFree(MEM_COLD, block, sizeof(*block) + block->len);
+}
+
+// the row's bytes, valid until another cold row is read or thawed
+const char *editorRowData(erow *row) {
+	if (!row->cold) return row->chars;
+	if (cold.cached != row->cold) {
+		if (row->cold->rawlen > cold.bufcap) {
+			cold.buf = memRealloc(MEM_COLD, cold.buf, cold.bufcap, row->cold->rawlen);
+			cold.bufcap = row->cold->rawlen;
+		}
+		coldDecompress(row->cold->data, row->cold->len, cold.buf, row->cold->rawlen);
+		cold.cached = row->cold;
+	}
+	return &cold.buf[row->cold_off];
+}
+
+/*
+ * the render text of a row without thawing it. a packed row is rendered
+ * into a shared buffer, valid until the next packed row is rendered.
+ */
+char *editorRowRender(erow *row, int *rsize) {
+	if (!row->cold) {
+		*rsize = row->rsize;
+		return row->render;
+	}
+	erow view = *row;
+	view.chars = (char *) editorRowData(row);
+	int tabs = 0, j, idx = 0, col = 0;
+	for (j = 0; j < row->size; j++)
+		if (view.chars[j] == '\t') tabs++;
+	int cap = row->size + tabs * (TAB_STOP - 1) + 1;
+	if (cap > cold.rendercap) {
+		cold.render = memRealloc(MEM_COLD, cold.render, cold.rendercap, cap);
+		cold.rendercap = cap;
+	}
+	// only tabs differ from the bytes, the same way editorRenderRow expands them
+	for (j = 0; j < row->size; ) {
+		int at = j, from = idx;
+		editorRowStep(&view, &j, &col, &idx);
+		if (view.chars[at] == '\t') memset(&cold.render[from], ' ', idx - from);
+		else memcpy(&cold.render[from], &view.chars[at], idx - from);
+	}
+	cold.render[idx] = '\0';
+	*rsize = idx;
+	return cold.render;
+}
+
+// brings a packed row back into plain chars and render
+void editorRowThaw(erow *row) {
+	row->stamp = cold.clock;
+	if (!row->cold) return;
+	const char *data = editorRowData(row);
+	row->chars = memRealloc(MEM_CHARS, NULL, 0, row->size + 1);
+	memcpy(row->chars, data, row->size);
+	row->chars[row->size] = '\0';
+	coldRelease(row->cold);
+	row->cold = NULL;
+	editorRenderRow(row);
+}
+
+int editorRowFreezable(erow *row) {
+	if (row->cold || (row->stamp && cold.clock - row->stamp <= COLD_AGE)) return 0;
+	int at = row->idx;
+	if (at > config.cy - COLD_WINDOW && at < config.cy + COLD_WINDOW) return 0;
+	return at <= config.rowoff - COLD_WINDOW ||
+	       at >= config.rowoff + config.screenrows + COLD_WINDOW;
+}
+
+/*
+ * packs rows start to end - 1 into one block. rows that are packed already
+ * move out of their old blocks, data then gives each row's bytes by offset
+ * from start; when it is NULL the rows are read from chars.
+ */
+void editorFreezeBlock(int start, int end, const char **data) {
+	int rawlen = 0, j;
+	for (j = start; j < end; j++) rawlen += config.row[j].size;
+	char *raw = malloc(rawlen + 1);
+	char *packed = malloc(rawlen + rawlen / 255 + 16);
+	for (rawlen = 0, j = start; j < end; j++) {
+		memcpy(&raw[rawlen], data ? data[j - start] : config.row[j].chars, config.row[j].size);
+		rawlen += config.row[j].size;
+	}
+	int len = coldCompress(raw, rawlen, packed);
+
+	struct coldBlock *block = memRealloc(MEM_COLD, NULL, 0, sizeof(*block) + len);
+	block->refs = end - start;
+	block->rawlen = rawlen;
+	block->len = len;
+	memcpy(block->data, packed, len);
+	for (rawlen = 0, j = start; j < end; j++) {
+		erow *row = &config.row[j];
+		if (row->cold) {
+			coldRelease(row->cold);
+			row->cold = block;
+			row->cold_off = rawlen;
+			rawlen += row->size;
+			continue;
+		}
+		// the words stay indexed, so the row is not freed as a whole
+		memFree(MEM_RENDER, row->render, row->rsize + 1);
+		memFree(MEM_CHARS, row->chars, row->size + 1);
+		if (row->hl_in != -1) memFree(MEM_HL, row->hl, row->rsize);
+		row->chars = NULL;
+		row->render = NULL;
+		row->rsize = 0;
+		row->hl = NULL;
+		row->hl_in = -1;
+		row->cold = block;
+		row->cold_off = rawlen;
+		rawlen += row->size;
+	}
+	free(raw);
+	free(packed);
+}
+
+// packs every row regardless of age, for a buffer that is not shown
+void editorFreezeAll() {
+	int start = 0;
+	while (start < config.numrows) {
+		int end = start, bytes = 0;
+		while (end < config.numrows && end - start < COLD_BLOCK_ROWS &&
+		       bytes < COLD_BLOCK_BYTES && !config.row[end].cold)
+			bytes += config.row[end++].size;
+		if (end > start) editorFreezeBlock(start, end, NULL);
+		else end = start + 1;
+		start = end;
+	}
+}
+
+/*
+ * called while waiting for input: packs runs of rows that are far from the
+ * viewport and were not touched recently. returns 0 once a whole pass over
+ * the file found nothing left to pack.
+ */
+int editorFreezeRows() {
+	if (config.numrows < COLD_MIN_ROWS || cold.idle >= config.numrows) return 0;
+	int scanned = 0, frozen = 0;
+	while (scanned < COLD_SCAN && frozen < COLD_BATCH && cold.idle < config.numrows) {
+		if (cold.scan >= config.numrows) cold.scan = 0;
+		int start = cold.scan, end = start, bytes = 0;
+		while (end < config.numrows && end - start < COLD_BLOCK_ROWS &&
+		       bytes < COLD_BLOCK_BYTES && editorRowFreezable(&config.row[end]))
+			bytes += config.row[end++].size;
+		if (end > start) {
+			editorFreezeBlock(start, end, NULL);
+			frozen++;
+			cold.idle = 0;
+		} else {
+			end = start + 1;
+		}
+		scanned += end - start;
+		cold.idle += end - start;
+		cold.scan = end;
+	}
+	return cold.idle < config.numrows;
+}
+
+/*** word index ***/
+
+int editorIsWordChar(int c) {
+	return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+int wordsBucket(const char *w) {
+	return (unsigned char) w[0] << 8 | (unsigned char) w[1];
+}
+
+void wordsLink(int i) {
+	struct wordEntry *e = &words.table[i];
+	int b = wordsBucket(e->word);
+	e->prev = -1;
+	e->next = words.heads[b];
+	if (e->next != -1) words.table[e->next].prev = i;
+	words.heads[b] = i;
+}
+
+// rehashes into cap slots, dropping removed ones
+void wordsResize(int cap) {
+	struct wordEntry *old = words.table;
+	int oldcap = words.cap;
+	words.table = memRealloc(MEM_WORDS, NULL, 0, sizeof(struct wordEntry) * cap);
+	memset(words.table, 0, sizeof(struct wordEntry) * cap);
+	words.cap = cap;
+	words.removed = 0;
+	if (!words.heads) words.heads = memRealloc(MEM_WORDS, NULL, 0, sizeof(int) * 65536);
+	memset(words.heads, -1, sizeof(int) * 65536);
+	for (int j = 0; j < oldcap; j++) {
+		if (old[j].count <= 0) continue;
+		int i = old[j].hash & (cap - 1);
+		while (words.table[i].count) i = (i + 1) & (cap - 1);
+		words.table[i] = old[j];
+		wordsLink(i);
+	}
+	memFree(MEM_WORDS, old, sizeof(struct wordEntry) * oldcap);
+}
+
+void wordsAdd(const char *w, int len, int delta) {
+	if (delta > 0 && (words.used + words.removed + 1) * 4 > words.cap * 3)
+		wordsResize((words.used + 1) * 2 < words.cap ? words.cap : (words.cap ? words.cap * 2 : 1024));
+	if (!words.cap) return;
+	uint64_t h = editorHashBytes(w, len);
+	int i = h & (words.cap - 1), slot = -1;
+	for (; words.table[i].count; i = (i + 1) & (words.cap - 1)) {
+		struct wordEntry *e = &words.table[i];
+		if (e->count < 0) {
+			if (slot == -1) slot = i;
+		} else if (e->hash == h && e->len == len && !memcmp(e->word, w, len)) {
+			e->count += delta;
+			if (e->count > 0) return;
+			// removed slots keep probe runs intact until the next resize
+			if (e->prev != -1) words.table[e->prev].next = e->next;
+			else words.heads[wordsBucket(e->word)] = e->next;
+			if (e->next != -1) words.table[e->next].prev = e->prev;
+			memFree(MEM_WORDS, e->word, len);
+			e->count = -1;
+			words.used--;
+			words.removed++;
+			return;
+		}
+	}
+	if (delta <= 0) return;
+	if (slot != -1) {
+		i = slot;
+		words.removed--;
+	}
+	struct wordEntry *e = &words.table[i];
+	e->hash = h;
+	e->len = len;
+	e->count = delta;
+	e->word = memRealloc(MEM_WORDS, NULL, 0, len);
+	memcpy(e->word, w, len);
+	wordsLink(i);
+	words.used++;
+}
+
+/*
+ * adds (delta 1) or removes (delta -1) the words of an indexed row that
+ * overlap from..to. edits only touch the words around them, so they
+ * remove those before changing chars and add them back afterwards.
+ */
+void editorRowWordsAround(erow *row, int from, int to, int delta) {
+	if (!row->indexed) return;
+	const char *s = editorRowData(row);
+	while (from > 0 && editorIsWordChar((unsigned char) s[from - 1])) from--;
+	while (to < row->size && editorIsWordChar((unsigned char) s[to])) to++;
+	int j = from;
+	while (j < to) {
+		if (!editorIsWordChar((unsigned char) s[j])) {
+			j++;
+			continue;
+		}
+		int start = j;
+		while (j < to && editorIsWordChar((unsigned char) s[j])) j++;
+		// single characters are not worth completing
+		if (j - start > 1) wordsAdd(&s[start], j - start, delta);
+	}
+}
+
+// adds or removes all of a row's words
+void editorRowWords(erow *row, int delta) {
+	if ((delta > 0) == (row->indexed != 0)) return;
+	if (delta > 0) row->indexed = 1;
+	editorRowWordsAround(row, 0, row->size, delta);
+	if (delta < 0) row->indexed = 0;
+	// only indexing takes a row off the queue, removing one never queued it
+	else words.pending--;
+}
+
+/*
+ * indexes rows added since the last call, up to budget of them. loading a
+ * file only queues its rows, so opening stays fast and the index fills in
+ * while the editor waits for input. returns whether rows are left.
+ */
+int editorIndexRows(int budget) {
+	while (words.pending > 0 && budget-- > 0) {
+		if (words.scan >= config.numrows) words.scan = 0;
+		editorRowWords(&config.row[words.scan++], 1);
+	}
+	return words.pending > 0;
+}
+
+void wordsFree() {
+	for (int j = 0; j < words.cap; j++)
+		if (words.table[j].count > 0) memFree(MEM_WORDS, words.table[j].word, words.table[j].len);
+	memFree(MEM_WORDS, words.table, sizeof(struct wordEntry) * words.cap);
+	memFree(MEM_WORDS, words.heads, sizeof(int) * 65536);
+	words.table = NULL;
+	words.heads = NULL;
+	words.cap = 0;
+	words.used = 0;
+	words.removed = 0;
+}
+
+/*** trigram index ***/
+
+// spaces in render may stand for a tab, so trigrams with either are left out
+int triUsable(const unsigned char *s) {
+	return s[0] != ' ' && s[0] != '\t' && s[1] != ' ' && s[1] != '\t' &&
+	       s[2] != ' ' && s[2] != '\t';
+}
+
+uint32_t triBucket(const unsigned char *s) {
+	uint32_t t = (uint32_t) s[0] << 16 | (uint32_t) s[1] << 8 | s[2];
+	return (t * 2654435761u) >> 16;
+}
+
+void editorTrigramsFree() {
+	memFree(MEM_INDEX, trigrams.list, sizeof(uint16_t) * trigrams.listcap);
+	memFree(MEM_INDEX, trigrams.starts, sizeof(size_t) * (trigrams.blocks + 1));
+	memFree(MEM_INDEX, trigrams.seen, TRI_BUCKETS / 8);
+	if (trigrams.mapped) munmap(trigrams.image, trigrams.len);
+	else memFree(MEM_INDEX, trigrams.image, trigrams.len);
+	if (trigrams.overlay) {
+		for (int b = 0; b < trigrams.blocks; b++)
+			memFree(MEM_INDEX, trigrams.overlay[b], TRI_OVERLAY_BITS / 8);
+		memFree(MEM_INDEX, trigrams.overlay, sizeof(unsigned char *) * trigrams.blocks);
+	}
+	memFree(MEM_INDEX, trigrams.cand, sizeof(uint64_t) * ((trigrams.blocks + 63) / 64));
+	free(trigrams.query);
+	memset(&trigrams, 0, sizeof(trigrams));
+}
+
+// .name.trigrams next to the file, returns 0 if that does not fit in len
+int editorTrigramsPath(char *buf, size_t len) {
+	const char *slash = strrchr(config.filename, '/');
+	int n;
+	if (slash)
+		n = snprintf(buf, len, "%.*s/.%s.trigrams", (int) (slash - config.filename), config.filename, slash + 1);
+	else
+		n = snprintf(buf, len, ".%s.trigrams", config.filename);
+	return n >= 0 && (size_t) n < len;
+}
+
+/*
+ * the sidecar sits beside the file and may have been shipped with it, so
+ * besides matching the key its lists must stay inside postings and name
+ * only blocks that exist; searches index both without further checks
+ */
+int triValid(const char *image, size_t len, const struct triHeader *key) {
+	const struct triHeader *hdr = (const struct triHeader *) image;
+	size_t base = sizeof(*hdr) + sizeof(uint64_t) * (TRI_BUCKETS + 1);
+	if (len < base) return 0;
+	const uint64_t *offsets = (const uint64_t *) &image[sizeof(*hdr)];
+	if (memcmp(hdr->magic, TRI_MAGIC, 4) || hdr->version != TRI_VERSION ||
+	    hdr->file_size != key->file_size || hdr->mtime_sec != key->mtime_sec ||
+	    hdr->mtime_nsec != key->mtime_nsec || hdr->hash != key->hash ||
+	    hdr->block_rows != key->block_rows || hdr->blocks != key->blocks ||
+	    hdr->size != len || offsets[TRI_BUCKETS] != hdr->npostings ||
+	    hdr->npostings != (len - base) / sizeof(uint32_t) || (len - base) % sizeof(uint32_t))
+		return 0;
+	if (offsets[0] != 0) return 0;
+	for (int k = 0; k < TRI_BUCKETS; k++)
+		if (offsets[k] > offsets[k + 1]) return 0;
+	const uint32_t *postings = (const uint32_t *) &image[base];
+	for (uint64_t p = 0; p < hdr->npostings; p++)
+		if (postings[p] >= hdr->blocks) return 0;
+	return 1;
+}
+
+void editorTrigramsUse(char *image, size_t len, int mapped) {
+	trigrams.image = image;
+	trigrams.len = len;
+	trigrams.mapped = mapped;
+	trigrams.offsets = (uint64_t *) &image[sizeof(struct triHeader)];
+	trigrams.postings = (uint32_t *) (trigrams.offsets + TRI_BUCKETS + 1);
+	trigrams.state = 2;
+}
+
+/*
+ * called once a file is read: splits it into blocks and maps the sidecar
+ * if it was written for the same contents, otherwise starts building one
+ */
+void editorTrigramsOpen() {
+	editorTrigramsFree();
+	if (!config.trigrams || config.numrows < TRI_MIN_ROWS || !config.file_known) return;
+
+	struct triHeader *key = &trigrams.key;
+	memcpy(key->magic, TRI_MAGIC, 4);
+	key->version = TRI_VERSION;
+	key->file_size = config.file_size;
+	key->mtime_sec = config.file_mtime.tv_sec;
+	key->mtime_nsec = config.file_mtime.tv_nsec;
+	key->hash = 1469598103934665603ULL;
+	// a block holds every bucket at most once, so larger files get longer blocks
+	long long rows = (long long) config.numrows * TRI_BLOCK_BYTES / (config.file_size + 1) + 1;
+	int block_rows = rows > TRI_BLOCK_ROWS ? rows : TRI_BLOCK_ROWS;
+	for (int j = 0; j < config.numrows; j++) {
+		key->hash = (key->hash ^ config.row[j].hash) * 1099511628211ULL;
+		config.row[j].tri = j / block_rows;
+	}
+	key->block_rows = block_rows;
+	key->blocks = trigrams.blocks = (config.numrows + block_rows - 1) / block_rows;
+	trigrams.overlay = memRealloc(MEM_INDEX, NULL, 0, sizeof(unsigned char *) * trigrams.blocks);
+	memset(trigrams.overlay, 0, sizeof(unsigned char *) * trigrams.blocks);
+	trigrams.cand = memRealloc(MEM_INDEX, NULL, 0, sizeof(uint64_t) * ((trigrams.blocks + 63) / 64));
+
+	char path[PATH_MAX];
+	int fd = editorTrigramsPath(path, sizeof(path)) ? open(path, O_RDONLY) : -1;
+	struct stat st;
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image != MAP_FAILED && triValid(image, st.st_size, key))
+			editorTrigramsUse(image, st.st_size, 1);
+		else if (image != MAP_FAILED)
+			munmap(image, st.st_size);
+	}
+	if (fd != -1) close(fd);
+	if (trigrams.state == 2) return;
+
+	trigrams.state = 1;
+	trigrams.starts = memRealloc(MEM_INDEX, NULL, 0, sizeof(size_t) * (trigrams.blocks + 1));
+	trigrams.seen = memRealloc(MEM_INDEX, NULL, 0, TRI_BUCKETS / 8);
+	memset(trigrams.seen, 0, TRI_BUCKETS / 8);
+}
+
+// first row at or past block b, or the last one at or before it if dir is -1
+int editorTrigramRow(int b, int dir) {
+	int lo = 0, hi = config.numrows;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (config.row[mid].tri < b + (dir < 0)) lo = mid + 1;
+		else hi = mid;
+	}
+	return dir < 0 ? lo - 1 : lo;
+}
+
+// lays the buckets out by block into postings and saves them if the file is unchanged
+void editorTrigramsFinish() {
+	struct triHeader hdr = trigrams.key;
+	hdr.npostings = trigrams.listlen;
+	hdr.size = sizeof(hdr) + sizeof(uint64_t) * (TRI_BUCKETS + 1) + sizeof(uint32_t) * hdr.npostings;
+	char *image = memRealloc(MEM_INDEX, NULL, 0, hdr.size);
+	memcpy(image, &hdr, sizeof(hdr));
+	uint64_t *offsets = (uint64_t *) &image[sizeof(hdr)];
+	uint32_t *postings = (uint32_t *) (offsets + TRI_BUCKETS + 1);
+
+	// counting sort, blocks come out ascending within each bucket
+	memset(offsets, 0, sizeof(uint64_t) * (TRI_BUCKETS + 1));
+	for (size_t j = 0; j < trigrams.listlen; j++) offsets[trigrams.list[j] + 1]++;
+	for (int k = 0; k < TRI_BUCKETS; k++) offsets[k + 1] += offsets[k];
+	uint64_t *fill = malloc(sizeof(uint64_t) * TRI_BUCKETS);
+	memcpy(fill, offsets, sizeof(uint64_t) * TRI_BUCKETS);
+	trigrams.starts[trigrams.blocks] = trigrams.listlen;
+	for (int b = 0; b < trigrams.blocks; b++)
+		for (size_t j = trigrams.starts[b]; j < trigrams.starts[b + 1]; j++)
+			postings[fill[trigrams.list[j]]++] = b;
+	free(fill);
+
+	memFree(MEM_INDEX, trigrams.list, sizeof(uint16_t) * trigrams.listcap);
+	memFree(MEM_INDEX, trigrams.starts, sizeof(size_t) * (trigrams.blocks + 1));
+	memFree(MEM_INDEX, trigrams.seen, TRI_BUCKETS / 8);
+	trigrams.list = NULL;
+	trigrams.starts = NULL;
+	trigrams.seen = NULL;
+	trigrams.listlen = trigrams.listcap = 0;
+	editorTrigramsUse(image, hdr.size, 0);
+
+	// blocks built after an edit saw the edit, which the file on disk lacks
+	if (config.dirty) return;
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	if (!editorTrigramsPath(path, sizeof(path))) return;
+	// a fresh name, so nothing planted in a shared directory is written through
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd == -1) return;
+	int ok = fchmod(fd, 0644) == 0 && write(fd, image, hdr.size) == (ssize_t) hdr.size;
+	close(fd);
+	if (!ok || rename(tmp, path) == -1) unlink(tmp);
+}
+
+// indexes whole blocks while waiting for input, returns whether any are left
+int editorTrigramRows(int budget) {
+	if (trigrams.state != 1) return 0;
+	while (trigrams.next < trigrams.blocks && budget > 0) {
+		int b = trigrams.next++, at = editorTrigramRow(b, 1);
+		trigrams.starts[b] = trigrams.listlen;
+		for (; at < config.numrows && config.row[at].tri == b; at++) {
+			erow *row = &config.row[at];
+			const unsigned char *s = (const unsigned char *) editorRowData(row);
+			budget -= row->size / 64 + 1;
+			for (int j = 0; j + 2 < row->size; j++) {
+				if (!triUsable(&s[j])) continue;
+				uint32_t k = triBucket(&s[j]);
+				if (trigrams.seen[k >> 3] & (1 << (k & 7))) continue;
+				trigrams.seen[k >> 3] |= 1 << (k & 7);
+				if (trigrams.listlen == trigrams.listcap) {
+					size_t cap = trigrams.listcap ? trigrams.listcap * 2 : 65536;
+					trigrams.list = memRealloc(MEM_INDEX, trigrams.list,
+						sizeof(uint16_t) * trigrams.listcap, sizeof(uint16_t) * cap);
+					trigrams.listcap = cap;
+				}
+				trigrams.list[trigrams.listlen++] = k;
+			}
+		}
+		for (size_t j = trigrams.starts[b]; j < trigrams.listlen; j++)
+			trigrams.seen[trigrams.list[j] >> 3] = 0;
+	}
+	if (trigrams.next == trigrams.blocks) editorTrigramsFinish();
+	return trigrams.state == 1;
+}
+
+// called from editorUpdateRow, so edited rows stay findable
+void editorTrigramRowChanged(erow *row) {
+	if (trigrams.state == 0) return;
+	unsigned char **bits = &trigrams.overlay[row->tri];
+	if (*bits == NULL) {
+		*bits = memRealloc(MEM_INDEX, NULL, 0, TRI_OVERLAY_BITS / 8);
+		memset(*bits, 0, TRI_OVERLAY_BITS / 8);
+	}
+	const unsigned char *s = (const unsigned char *) editorRowData(row);
+	for (int j = 0; j + 2 < row->size; j++) {
+		if (!triUsable(&s[j])) continue;
+		uint32_t k = triBucket(&s[j]) & (TRI_OVERLAY_BITS - 1);
+		(*bits)[k >> 3] |= 1 << (k & 7);
+	}
+	free(trigrams.query);
+	trigrams.query = NULL;
+}
+
+int triPosted(uint32_t k, uint32_t b) {
+	uint64_t lo = trigrams.offsets[k], hi = trigrams.offsets[k + 1];
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (trigrams.postings[mid] < b) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < trigrams.offsets[k + 1] && trigrams.postings[lo] == b;
+}
+
+/*
+ * marks the blocks that may hold query: those posted under every one of
+ * its buckets, or whose edits added them all. returns 0 if the index
+ * cannot narrow the search, e.g. for queries shorter than a trigram.
+ */
+int editorTrigramCandidates(const char *query) {
+	if (trigrams.state != 2) return 0;
+	if (trigrams.query && !strcmp(trigrams.query, query)) return trigrams.narrowed;
+	free(trigrams.query);
+	trigrams.query = strdup(query);
+	trigrams.narrowed = 0;
+
+	int len = strlen(query), n = 0, best = -1;
+	const unsigned char *s = (const unsigned char *) query;
+	uint32_t *keys = malloc(sizeof(uint32_t) * (len > 2 ? len : 1));
+	for (int j = 0; j + 2 < len; j++) {
+		if (!triUsable(&s[j])) continue;
+		uint32_t k = triBucket(&s[j]);
+		int dup = 0;
+		for (int i = 0; i < n; i++) dup |= keys[i] == k;
+		if (dup) continue;
+		keys[n] = k;
+		// the shortest posting list bounds the work, the others are probed
+		if (best == -1 || trigrams.offsets[k + 1] - trigrams.offsets[k] <
+		                  trigrams.offsets[keys[best] + 1] - trigrams.offsets[keys[best]])
+			best = n;
+		n++;
+	}
+	if (n == 0) {
+		free(keys);
+		return 0;
+	}
+
+	memset(trigrams.cand, 0, sizeof(uint64_t) * ((trigrams.blocks + 63) / 64));
+	uint32_t k0 = keys[best];
+	for (uint64_t p = trigrams.offsets[k0]; p < trigrams.offsets[k0 + 1]; p++) {
+		uint32_t b = trigrams.postings[p];
+		int i;
+		for (i = 0; i < n && (i == best || triPosted(keys[i], b)); i++);
+		if (i == n) trigrams.cand[b >> 6] |= 1ULL << (b & 63);
+	}
+	for (int b = 0; b < trigrams.blocks; b++) {
+		unsigned char *bits = trigrams.overlay[b];
+		if (!bits) continue;
+		int i;
+		for (i = 0; i < n; i++) {
+			uint32_t k = keys[i] & (TRI_OVERLAY_BITS - 1);
+			if (!(bits[k >> 3] & (1 << (k & 7)))) break;
+		}
+		if (i == n) trigrams.cand[b >> 6] |= 1ULL << (b & 63);
+	}
+	free(keys);
+	trigrams.narrowed = 1;
+	return 1;
+}
+
+// nearest row from at on in direction dir in a candidate block, -1 if none before the edge
+int editorTrigramNext(int at, int dir) {
+	int b = config.row[at].tri;
+	while (b >= 0 && b < trigrams.blocks) {
+		uint64_t w = trigrams.cand[b >> 6];
+		if (w == 0) {
+			b = dir > 0 ? (b | 63) + 1 : (b & ~63) - 1;
+			continue;
+		}
+		if (w >> (b & 63) & 1) break;
+		b += dir;
+	}
+	if (b < 0 || b >= trigrams.blocks) return -1;
+	if (b == config.row[at].tri) return at;
+	int row = editorTrigramRow(b, dir);
+	return row >= 0 && row < config.numrows ? row : -1;
+}
+
+/*** brackets ***/
+
+int editorBracketDir(int c) {
+	if (c == '(' || c == '[' || c == '{') return 1;
+	if (c == ')' || c == ']' || c == '}') return -1;
+	return 0;
+}
+
+int editorBracketIgnored(int hl) {
+	return hl == HL_STRING || hl == HL_COMMENT || hl == HL_MLCOMMENT;
+}
+
+struct bracketSum bracketCombine(struct bracketSum l, struct bracketSum r) {
+	struct bracketSum s = { l.net + r.net, l.min < l.net + r.min ? l.min : l.net + r.min };
+	return s;
+}
+
+// brackets outside strings and comments, hl NULL counting all of them
+struct bracketSum editorBracketScan(erow *row, unsigned char *hl) {
+	struct bracketSum s = { 0, 0 };
+	for (int j = 0; j < row->rsize; j++) {
+		int dir = editorBracketDir(row->render[j]);
+		if (!dir || (hl && editorBracketIgnored(hl[j]))) continue;
+		s.net += dir;
+		if (s.net < s.min) s.min = s.net;
+	}
+	return s;
+}
+
+// summarizes the row for both comment states it may start in
+void editorRowBrackets(erow *row) {
+	if (!row->brk_valid) brackets.pending--;
+	row->brk_valid = 1;
+	row->brk[0] = row->brk[1] = (struct bracketSum) { 0, 0 };
+	// packed rows are scanned where they are rather than thawed
+	erow view = *row;
+	view.render = editorRowRender(row, &view.rsize);
+	if (!memchr(view.render, '(', view.rsize) && !memchr(view.render, ')', view.rsize) &&
+	    !memchr(view.render, '[', view.rsize) && !memchr(view.render, ']', view.rsize) &&
+	    !memchr(view.render, '{', view.rsize) && !memchr(view.render, '}', view.rsize))
+		return;
+	if (config.syntax == NULL) {
+		row->brk[0] = row->brk[1] = editorBracketScan(&view, NULL);
+		return;
+	}
+	if (view.rsize > brackets.scratchcap) {
+		brackets.scratch = memRealloc(MEM_INDEX, brackets.scratch, brackets.scratchcap, view.rsize);
+		brackets.scratchcap = view.rsize;
+	}
+	for (int in = 0; in < 2; in++) {
+		editorHighlightRow(&view, in, brackets.scratch);
+		row->brk[in] = editorBracketScan(&view, brackets.scratch);
+	}
+}
+
+struct bracketSum editorRowBracketSum(int at) {
+	return config.row[at].brk[at ? config.hl_state[at - 1] : 0];
+}
+
+// leaf of row at, rows from the gap on sit past it
+int bracketLeaf(int at) {
+	return brackets.size + (at < brackets.gap ? at : at + brackets.gaplen);
+}
+
+// recomputes the nodes above leaves lo to hi
+void bracketPull(int lo, int hi) {
+	int l = brackets.size + lo, r = brackets.size + hi;
+	while (l > 1) {
+		l >>= 1;
+		r >>= 1;
+		for (int p = l; p <= r; p++)
+			brackets.tree[p] = bracketCombine(brackets.tree[2 * p], brackets.tree[2 * p + 1]);
+	}
+}
+
+// brings the leaf of row at up to date with its summary and starting state
+void editorBracketsSet(int at) {
+	if (!brackets.active || brackets.stale || at >= brackets.size - brackets.gaplen) return;
+	// a row without a summary sets its leaf once it gets one
+	if (!config.row[at].brk_valid) return;
+	int p = bracketLeaf(at);
+	brackets.tree[p] = editorRowBracketSum(at);
+	bracketPull(p - brackets.size, p - brackets.size);
+}
+
+// moves the gap to just before row at, shifting the leaves in between
+void bracketMoveGap(int at) {
+	struct bracketSum *leaf = &brackets.tree[brackets.size];
+	int g = brackets.gap, len = brackets.gaplen, lo, hi;
+	if (at < g) {
+		memmove(&leaf[at + len], &leaf[at], sizeof(*leaf) * (g - at));
+		lo = at;
+		hi = g < at + len ? g : at + len;
+		bracketPull(at + len, g + len - 1);
+	} else if (at > g) {
+		memmove(&leaf[g], &leaf[g + len], sizeof(*leaf) * (at - g));
+		lo = at > g + len ? at : g + len;
+		hi = at + len;
+		bracketPull(g, at - 1);
+	} else return;
+	// the leaves left behind join the gap
+	memset(&leaf[lo], 0, sizeof(*leaf) * (hi - lo));
+	if (lo < hi) bracketPull(lo, hi - 1);
+	brackets.gap = at;
+}
+
+// row at was inserted, its leaf is set when it is summarized
+void editorBracketsInsert(int at) {
+	if (!brackets.active || brackets.stale) return;
+	if (brackets.gaplen == 0) {
+		brackets.stale = 1;
+		return;
+	}
+	bracketMoveGap(at);
+	brackets.gap++;
+	brackets.gaplen--;
+}
+
+void editorBracketsDelete(int at) {
+	if (!brackets.active || brackets.stale) return;
+	bracketMoveGap(at);
+	int p = bracketLeaf(at);
+	brackets.tree[p] = (struct bracketSum) { 0, 0 };
+	bracketPull(p - brackets.size, p - brackets.size);
+	brackets.gaplen++;
+}
+
+// called from editorUpdateRow once the row's comment transitions are current
+void editorBracketsRowChanged(erow *row) {
+	if (!brackets.active) {
+		if (row->brk_valid) brackets.pending++;
+		row->brk_valid = 0;
+		return;
+	}
+	editorRowBrackets(row);
+	editorBracketsSet(row->idx);
+}
+
+/*
+ * summarizes up to budget rows that have no summary yet, from the idle
+ * loop. once every row has one, edits keep theirs current. returns
+ * whether rows are left.
+ */
+int editorBracketRows(int budget) {
+	while (brackets.pending > 0 && budget-- > 0) {
+		if (brackets.scan >= config.numrows) brackets.scan = 0;
+		erow *row = &config.row[brackets.scan++];
+		if (!row->brk_valid) editorRowBrackets(row);
+	}
+	if (brackets.pending == 0 && !brackets.active) {
+		// nothing kept the leaves current while summaries were missing
+		brackets.active = 1;
+		brackets.stale = 1;
+	}
+	return !brackets.active;
+}
+
+/*
+ * builds every leaf from the rows' current starting states. states not
+ * known yet are fixed up leaf by leaf as the highlighter settles them.
+ */
+void editorBracketsRebuild() {
+	if (!brackets.stale) return;
+	int n = config.numrows, size = brackets.size ? brackets.size : 1024;
+	// leaves a gap so the next insert does not rebuild again
+	while (size <= n) size *= 2;
+	if (size != brackets.size) {
+		memFree(MEM_INDEX, brackets.tree, sizeof(struct bracketSum) * 2 * brackets.size);
+		brackets.tree = memRealloc(MEM_INDEX, NULL, 0, sizeof(struct bracketSum) * 2 * size);
+		brackets.size = size;
+	}
+	for (int j = 0; j < size; j++)
+		brackets.tree[size + j] = j < n ? editorRowBracketSum(j) : (struct bracketSum) { 0, 0 };
+	for (int p = size - 1; p >= 1; p--)
+		brackets.tree[p] = bracketCombine(brackets.tree[2 * p], brackets.tree[2 * p + 1]);
+	brackets.gap = n;
+	brackets.gaplen = size - n;
+	brackets.stale = 0;
+}
+
+// row whose leaf is p, for leaves outside the gap
+int bracketRow(int p) {
+	return p < brackets.gap ? p : p - brackets.gaplen;
+}
+
+// first row from "from" on where depth d, counted from its start, reaches 0
+int bracketForward(int node, int lo, int hi, int from, int *d) {
+	if (hi <= from) return -1;
+	struct bracketSum *s = &brackets.tree[node];
+	if (lo >= from && *d + s->min > 0) {
+		*d += s->net;
+		return -1;
+	}
+	if (hi - lo == 1) return lo;
+	int mid = (lo + hi) / 2, r = bracketForward(2 * node, lo, mid, from, d);
+	return r != -1 ? r : bracketForward(2 * node + 1, mid, hi, from, d);
+}
+
+// last row before "upto" where depth d, counted back from its end, reaches 0
+int bracketBackward(int node, int lo, int hi, int upto, int *d) {
+	if (lo >= upto) return -1;
+	struct bracketSum *s = &brackets.tree[node];
+	// the deepest point seen from the right is the total minus the lowest prefix
+	if (hi <= upto && s->net - s->min < *d) {
+		*d -= s->net;
+		return -1;
+	}
+	if (hi - lo == 1) return lo;
+	int mid = (lo + hi) / 2, r = bracketBackward(2 * node + 1, mid, hi, upto, d);
+	return r != -1 ? r : bracketBackward(2 * node, lo, mid, upto, d);
+}
+
+// walks render from off in direction dir until depth d reaches 0
+int editorBracketWalk(erow *row, int off, int dir, int *d) {
+	editorRowEnsureSyntax(row);
+	for (int j = off; j >= 0 && j < row->rsize; j += dir) {
+		int b = editorBracketDir(row->render[j]);
+		if (!b || editorBracketIgnored(row->hl[j])) continue;
+		*d += b * dir;
+		if (*d == 0) return j;
+	}
+	return -1;
+}
+
+/*
+ * finds the partner of the bracket at render offset off in row at. only
+ * the two end rows are scanned, the rows between are skipped through the
+ * tree. returns 0 if there is no bracket there or it is unmatched.
+ */
+int editorBracketMatch(int at, int off, int *prow, int *poff) {
+	erow *row = &config.row[at];
+	editorRowEnsureSyntax(row);
+	if (off >= row->rsize) return 0;
+	int dir = editorBracketDir(row->render[off]);
+	if (!dir || editorBracketIgnored(row->hl[off])) return 0;
+	editorBracketsRebuild();
+
+	int d = 1, j = editorBracketWalk(row, off + dir, dir, &d);
+	while (j == -1) {
+		// leaves in the gap are empty, so the searches pass over them
+		int p = dir > 0 ? bracketForward(1, 0, brackets.size, bracketLeaf(at + 1) - brackets.size, &d)
+		                : bracketBackward(1, 0, brackets.size, bracketLeaf(at) - brackets.size, &d);
+		if (p == -1) return 0;
+		at = bracketRow(p);
+		row = &config.row[at];
+		j = editorBracketWalk(row, dir > 0 ? 0 : row->rsize - 1, dir, &d);
+	}
+	*prow = at;
+	*poff = j;
+	return 1;
+}
+
+// the bracket under the cursor, or else the one just before it
+int editorBracketAtCursor(erow *row) {
+	int off = editorRowCxToRender(row, config.cx);
+	if (off < row->rsize && editorBracketDir(row->render[off])) return off;
+	if (off > 0 && editorBracketDir(row->render[off - 1])) return off - 1;
+	return off;
+}
+
+// finds what to highlight for the cursor, once the summaries are complete
+void editorBracketsUpdateMatch() {
+	brackets.match_row = -1;
+	if (!brackets.active || config.cy >= config.numrows) return;
+	erow *row = &config.row[config.cy];
+	if (!editorBracketMatch(config.cy, editorBracketAtCursor(row),
+	                        &brackets.match_row, &brackets.match_off))
+		brackets.match_row = -1;
+}
+
+void editorBracketJump() {
+	if (config.cy >= config.numrows) return;
+	editorBracketRows(config.numrows);
+	// a jump waits for the comment states the highlight may still be settling
+	editorSyntaxAdvance(config.numrows);
+	erow *row = &config.row[config.cy];
+	int off = editorBracketAtCursor(row), prow, poff;
+	if (!editorBracketMatch(config.cy, off, &prow, &poff)) {
+		editorSetMessage(editorBracketDir(off < row->rsize ? row->render[off] : 0) ?
+			"No matching bracket" : "Not on a bracket");
+		return;
+	}
+	char c = row->render[off], p = config.row[prow].render[poff];
+	if (!strchr(c == '(' || c == ')' ? "()" : c == '[' || c == ']' ? "[]" : "{}", p))
+		editorSetMessage("Mismatched bracket %c for %c", p, c);
+	config.cy = prow;
+	config.cx = editorRowRenderToCx(&config.row[prow], poff);
+}
+
+void editorBracketsFree() {
+	memFree(MEM_INDEX, brackets.tree, sizeof(struct bracketSum) * 2 * brackets.size);
+	memFree(MEM_INDEX, brackets.scratch, brackets.scratchcap);
+	brackets.tree = NULL;
+	brackets.scratch = NULL;
+	brackets.size = brackets.scratchcap = 0;
+	brackets.gap = brackets.gaplen = brackets.stale = 0;
+	brackets.pending = brackets.scan = brackets.active = 0;
+	brackets.match_row = -1;
+}
+
+/*** row operations ***/
+
+// hashes 8 bytes at a time; used to compare rows without touching chars
+uint64_t editorHashBytes(const char *s, size_t len) {
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	uint64_t w;
+	while (len >= 8) {
+		memcpy(&w, s, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+		s += 8;
+		len -= 8;
+	}
+	w = 0;
+	memcpy(&w, s, len);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 29;
+	return h;
+}
+
+// moves past the character at cx, tracking its column and render offset
+void editorRowStep(erow *row, int *cx, int *rx, int *roff) {
+	int cp, n;
+	if (row->chars[*cx] == '\t') {
+		int w = TAB_STOP - *rx % TAB_STOP;
+		*rx += w;
+		*roff += w;
+		(*cx)++;
+	} else if (row->ascii) {
+		(*rx)++;
+		(*roff)++;
+		(*cx)++;
+	} else {
+		n = editorUtf8Decode(&row->chars[*cx], row->size - *cx, &cp);
+		*rx += editorCharWidth(cp);
+		*roff += n;
+		*cx += n;
+	}
+}
 
 int editorRowCxToRx(erow *row, int cx) {
 	int rx = 0;
 	int j;
+	if (!row->ascii) {
+		int roff = 0;
+		for (j = 0; j < cx && j < row->size; ) editorRowStep(row, &j, &rx, &roff);
+		return rx;
+	}
 	for (j = 0; j < cx; j++) {
 		if (row->chars[j] == '\t')
 			rx += (TAB_STOP - 1) - (rx % TAB_STOP);
@@ -439,6 +2965,15 @@ int editorRowCxToRx(erow *row, int cx) {
 int editorRowRxToCx(erow *row, int rx) {
 	int cur_rx = 0;
 	int cx;
+	if (!row->ascii) {
+		int roff = 0;
+		for (cx = 0; cx < row->size; ) {
+			int at = cx;
+			editorRowStep(row, &cx, &cur_rx, &roff);
+			if (cur_rx > rx) return at;
+		}
+		return cx;
+	}
 	for (cx = 0; cx < row->size; cx++) {
 		if (row->chars[cx] == '\t')
 			cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
@@ -449,53 +2984,207 @@ int editorRowRxToCx(erow *row, int rx) {
 	return cx;
 }
 
-void editorUpdateRow(erow *row) {
+// offset into render of the character at cx
+int editorRowCxToRender(erow *row, int cx) {
+	if (row->ascii) return editorRowCxToRx(row, cx);
+	int j, rx = 0, roff = 0;
+	for (j = 0; j < cx && j < row->size; ) editorRowStep(row, &j, &rx, &roff);
+	return roff;
+}
+
+// the character that render offset roff belongs to, e.g. for a search match
+int editorRowRenderToCx(erow *row, int roff) {
+	int cx = 0, rx = 0, cur = 0;
+	while (cx < row->size && cur < roff) {
+		int at = cx;
+		editorRowStep(row, &cx, &rx, &cur);
+		if (cur > roff) return at;
+	}
+	return cx;
+}
+
+int editorRowPrevChar(erow *row, int cx) {
+	if (cx <= 0) return 0;
+	if (row->ascii) return cx - 1;
+	int at = cx - 1, cp;
+	while (at > 0 && cx - at < 4 && (row->chars[at] & 0xc0) == 0x80) at--;
+	// continuation bytes that do not follow a matching lead stand alone
+	if (at + editorUtf8Decode(&row->chars[at], row->size - at, &cp) != cx) at = cx - 1;
+	return at;
+}
+
+int editorRowNextChar(erow *row, int cx) {
+	if (cx >= row->size) return row->size;
+	if (row->ascii) return cx + 1;
+	int cp;
+	return cx + editorUtf8Decode(&row->chars[cx], row->size - cx, &cp);
+}
+
+// moves cx back to the start of the character it points into
+int editorRowSnapCx(erow *row, int cx) {
+	if (row->ascii || cx <= 0 || cx >= row->size) return cx;
+	int at = editorRowPrevChar(row, cx);
+	return editorRowNextChar(row, at) > cx ? at : cx;
+}
+
+// rebuilds render from chars
+void editorRenderRow(erow *row) {
 	int tabs = 0;
 	int j;
 	for(j = 0; j < row->size; j++)
 		if (row->chars[j] == '\t') tabs++;
 
-	// Update render row
-	free(row->render);
-	row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
+	// Update render row, hl is rebuilt lazily for the new size
+	memFree(MEM_RENDER, row->render, row->rsize + 1);
+	if (row->hl_in != -1) memFree(MEM_HL, row->hl, row->rsize);
+	row->hl = NULL;
+	row->hl_in = -1;
+	row->render = memRealloc(MEM_RENDER, NULL, 0, row->size + tabs * (TAB_STOP - 1) + 1);
 
 	// Convert tabs to spaces for rendering
-	int idx = 0;
-	for(j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
-		} else {
-			row->render[idx++] = row->chars[j];
+	int idx = 0, col = 0;
+	row->wide = 0;
+	if (row->ascii) {
+		for(j = 0; j < row->size; j++) {
+			if (row->chars[j] == '\t') {
+				row->render[idx++] = ' ';
+				while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
+			} else {
+				row->render[idx++] = row->chars[j];
+			}
+		}
+	} else {
+		// tab stops are columns here, which wide and combining characters skew
+		for (j = 0; j < row->size; ) {
+			int at = j, from = idx, was = col;
+			editorRowStep(row, &j, &col, &idx);
+			if (row->chars[at] == '\t') memset(&row->render[from], ' ', idx - from);
+			else {
+				memcpy(&row->render[from], &row->chars[at], idx - from);
+				if (col - was > 1) row->wide = 1;
+			}
 		}
 	}
 	row->render[idx] = '\0';
 	row->rsize = idx;
+	row->cols = row->ascii ? idx : col;
+	// tabs short of a full stop leave slack, which frees would not account for
+	if (tabs) row->render = memRealloc(MEM_RENDER, row->render,
+		row->size + tabs * (TAB_STOP - 1) + 1, idx + 1);
+}
+
+void editorUpdateRow(erow *row) {
+	row->ascii = editorIsAscii(row->chars, row->size);
+	editorRenderRow(row);
+	row->hash = editorHashBytes(row->chars, row->size);
+	row->stamp = cold.clock;
 
 	editorUpdateSyntax(row);
+	fenwickUpdate(&config.offsets, row);
+	fenwickUpdate(&config.layout, row);
+	editorBracketsRowChanged(row);
+	editorTrigramRowChanged(row);
+}
+
+long long editorRowBytes(erow *row) {
+	return row->size + 1;
+}
+
+// columns left for text beside the gutter; the bars span the whole screen
+int editorTextCols() {
+	return config.screencols - (config.gutter ? GUTTER_COLS : 0);
+}
+
+/*
+ * walks a wrapped row up to column *rx or the start of screen line "line",
+ * whichever comes first, and returns the line reached with *rx and *col set
+ * to where on it. a wide character that would straddle the right edge moves
+ * whole to the next line, so lines of rows holding them may end short.
+ */
+int editorWrapWalk(erow *row, int *rx, int line, int *col) {
+	int w = editorTextCols();
+	if (!row->wide) {
+		int l = *rx / w < line ? *rx / w : line;
+		if (l < *rx / w) *rx = l * w;
+		*col = *rx - l * w;
+		return l;
+	}
+	const char *s = editorRowData(row);
+	int j = 0, c = 0, l = 0, lc = 0;
+	while (j < row->size) {
+		int cp, n = 1, cw;
+		if (s[j] == '\t') cw = TAB_STOP - c % TAB_STOP;
+		else {
+			n = editorUtf8Decode(&s[j], row->size - j, &cp);
+			cw = editorCharWidth(cp);
+		}
+		if (cw > 1 && s[j] != '\t' && lc > 0 && lc + cw > w) {
+			l++;
+			lc = 0;
+		}
+		if (c >= *rx || l >= line) break;
+		c += cw;
+		lc += cw;
+		l += lc / w;
+		lc %= w;
+		j += n;
+	}
+	*rx = c;
+	*col = lc;
+	return l;
+}
+
+// a row exactly filling its last line gets another for the cursor after it
+long long editorRowLines(erow *row) {
+	if (!row->wide) return row->cols / editorTextCols() + 1;
+	int rx = row->cols, col;
+	return editorWrapWalk(row, &rx, INT_MAX, &col) + 1;
+}
+
+// fills in a fresh row without rendering it
+void editorInitRow(erow *row, int at, const char *s, size_t len) {
+	row->idx = at;
+
+	row->size = len;
+	row->chars = memRealloc(MEM_CHARS, NULL, 0, len + 1);
+	// Insert data
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+	// Initialize render memory
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->hl_in = -1;
+	row->cold = NULL;
+	row->indexed = 0;
+	words.pending++;
+	row->brk_valid = 0;
+	brackets.pending++;
+	// an inserted row joins the block of the row above
+	row->tri = at ? config.row[at - 1].tri : 0;
+	row->base = at ? config.row[at - 1].base : 0;
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
 	if (at < 0 || at > config.numrows) return;
 
-	// Allocate erow and char memory
-	config.row = realloc(config.row, sizeof(erow) * (config.numrows + 1));
+	// Allocate erow and char memory, growing the array geometrically
+	if (config.numrows + 1 > config.rowcap) {
+		int cap = config.rowcap ? config.rowcap * 2 : 16;
+		config.row = memRealloc(MEM_ROWS, config.row, sizeof(erow) * config.rowcap,
+			sizeof(erow) * cap);
+		editorSyntaxResize(config.rowcap, cap);
+		config.rowcap = cap;
+	}
+	editorBracketsInsert(at);
+	editorSyntaxInsert(at);
+	fenwickInvalidate(&config.offsets, at);
+	fenwickInvalidate(&config.layout, at);
 	memmove(&config.row[at + 1], &config.row[at], sizeof(erow) * (config.numrows - at));
 	for (int j = at + 1; j <= config.numrows; j++)
 		config.row[j].idx++;
 
-	config.row[at].idx = at;
-
-	config.row[at].size = len;
-	config.row[at].chars = malloc(len + 1);
-	// Insert data
-	memcpy(config.row[at].chars, s, len);
-	config.row[at].chars[len] = '\0';
-	// Initialize render memory
-	config.row[at].rsize = 0;
-	config.row[at].render = NULL;
-	config.row[at].hl = NULL;
-	config.row[at].hl_open_comment = 0;
+	editorInitRow(&config.row[at], at, s, len);
 	// Update editor
 	editorUpdateRow(&config.row[at]);
 	config.numrows++;
@@ -503,9 +3192,16 @@ void editorInsertRow(int at, char *s, size_t len) {
 }
 
 void editorFreeRow(erow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+	if (row->indexed) editorRowWords(row, -1);
+	else words.pending--;
+	if (!row->brk_valid) brackets.pending--;
+	if (row->cold) {
+		coldRelease(row->cold);
+		return;
+	}
+	memFree(MEM_RENDER, row->render, row->rsize + 1);
+	memFree(MEM_CHARS, row->chars, row->size + 1);
+	if (row->hl_in != -1) memFree(MEM_HL, row->hl, row->rsize);
 }
 
 void editorDelRow(int at) {
@@ -514,6 +3210,10 @@ void editorDelRow(int at) {
 	editorFreeRow(&config.row[at]);
 	// shift right side of array to the left by one
 	memmove(&config.row[at], &config.row[at + 1], sizeof(erow) * (config.numrows - at - 1));
+	editorBracketsDelete(at);
+	editorSyntaxDelete(at);
+	fenwickInvalidate(&config.offsets, at);
+	fenwickInvalidate(&config.layout, at);
 	for (int j = at; j < config.numrows - 1; j++)
 		config.row[j].idx--;
 	// update editor
@@ -522,36 +3222,48 @@ void editorDelRow(int at) {
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
+	editorRowThaw(row);
 	if (at < 0 || at > row->size) at = row->size;
+	editorRowWordsAround(row, at, at, -1);
 	// shift right side of row one to the right
-	row->chars = realloc(row->chars, row->size + 2);
+	row->chars = memRealloc(MEM_CHARS, row->chars, row->size + 1, row->size + 2);
 	memmove(&row->chars[at + 1], &row->chars[at], row->size -at + 1);
 	row->size++;
 	// insert character
 	row->chars[at] = c;
 	editorUpdateRow(row);
+	editorRowWordsAround(row, at, at + 1, 1);
 	config.dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
+	editorRowThaw(row);
+	editorRowWordsAround(row, row->size, row->size, -1);
 	// resize row
-	row->chars = realloc(row->chars, row->size + len + 1);
+	row->chars = memRealloc(MEM_CHARS, row->chars, row->size + 1, row->size + len + 1);
 	// append char* to row
 	memcpy(&row->chars[row->size], s, len);
 	row->size += len;
 	row->chars[row->size] = '\0';
 	// update editor
 	editorUpdateRow(row);
+	editorRowWordsAround(row, row->size - len, row->size, 1);
 	config.dirty++;
 }
 
 void editorRowDelChar(erow *row, int at) {
 	if (at < 0 || at >= row->size) return;
+	editorRowThaw(row);
+	// the whole character goes, however many bytes it takes
+	int len = editorRowNextChar(row, at) - at;
+	editorRowWordsAround(row, at, at + len, -1);
 	// move right side of row to the left
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
+	memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+	row->chars = memRealloc(MEM_CHARS, row->chars, row->size + 1, row->size - len + 1);
+	row->size -= len;
 	// update editor
 	editorUpdateRow(row);
+	editorRowWordsAround(row, at, at, 1);
 	config.dirty++;
 }
 
@@ -570,11 +3282,15 @@ void editorInsertNewLine() {
 		editorInsertRow(config.cy, "", 0);
 	} else {
 		erow *row = &config.row[config.cy];
+		editorRowThaw(row);
 		editorInsertRow(config.cy + 1, &row->chars[config.cx], row->size - config.cx);
 		row = &config.row[config.cy];
+		editorRowWordsAround(row, config.cx, row->size, -1);
+		row->chars = memRealloc(MEM_CHARS, row->chars, row->size + 1, config.cx + 1);
 		row->size = config.cx;
 		row->chars[row->size] = '\0';
 		editorUpdateRow(row);
+		editorRowWordsAround(row, config.cx, config.cx, 1);
 	}
 	config.cy++;
 	config.cx = 0;
@@ -585,10 +3301,11 @@ void editorDelChar() {
 	if (config.cx == 0 && config.cy == 0) return;
 
 	erow *row = &config.row[config.cy];
+	editorRowThaw(row);
 	if (config.cx > 0) {
 		// delete previous char
-		editorRowDelChar(row, config.cx - 1);
-		config.cx--;
+		config.cx = editorRowPrevChar(row, config.cx);
+		editorRowDelChar(row, config.cx);
 	} else {
 		// delete newline
 		config.cx = config.row[config.cy - 1].size;
@@ -610,7 +3327,8 @@ char *editorRowsToString(int *buflen) {
 	char *buf = malloc(totlen);
 	char *p = buf;
 	for (j = 0; j < config.numrows; j++) {
-		memcpy(p, config.row[j].chars, config.row[j].size);
+		// packed rows are copied straight out of their block
+		memcpy(p, editorRowData(&config.row[j]), config.row[j].size);
 		p += config.row[j].size;
 		*p = '\n';
 		p++;
@@ -641,6 +3359,9 @@ void editorOpen(char* filename) {
 	free(line);
 	fclose(fp);
 	config.dirty = 0;
+	editorRecordFileStat();
+	editorGutterRebase();
+	editorTrigramsOpen();
 }
 
 void editorSave() {
@@ -663,6 +3384,8 @@ void editorSave() {
 				close(fd);
 				free(buf);
 				config.dirty = 0;
+				editorRecordFileStat();
+				editorGutterRebase();
 				editorSetMessage("%d bytes written to disk", len);
 				return;
 			}
@@ -674,6 +3397,287 @@ void editorSave() {
 	editorSetMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
+void editorCloseFile() {
+	int j;
+	// emptied first so freeing the rows does not remove their words one by one
+	wordsFree();
+	for (j = 0; j < config.numrows; j++) editorFreeRow(&config.row[j]);
+	words.pending = 0;
+	words.scan = 0;
+	editorBracketsFree();
+	editorTrigramsFree();
+	memFree(MEM_ROWS, config.row, sizeof(erow) * config.rowcap);
+	editorSyntaxResize(config.rowcap, 0);
+	fenwickFree(&config.offsets);
+	fenwickFree(&config.layout);
+	memFree(MEM_ROWS, config.saved, sizeof(uint64_t) * config.nsaved);
+	config.saved = NULL;
+	config.nsaved = 0;
+	memFree(MEM_COLD, cold.buf, cold.bufcap);
+	cold.buf = NULL;
+	cold.bufcap = 0;
+	memFree(MEM_COLD, cold.render, cold.rendercap);
+	cold.render = NULL;
+	cold.rendercap = 0;
+	cold.cached = NULL;
+	free(config.filename);
+	config.row = NULL;
+	config.rowcap = 0;
+	config.numrows = 0;
+	config.filename = NULL;
+	// drops whatever the highlighter thread is still working on
+	config.hl_version = ++highlighter.version;
+	config.hl_valid = 0;
+	config.hl_dirty = 0;
+}
+
+/*** external changes ***/
+
+// remembers which on-disk file the buffer was last synced with
+void editorRecordFileStat() {
+	struct stat st;
+	config.file_conflict = 0;
+	config.file_known = (config.filename && stat(config.filename, &st) == 0);
+	if (!config.file_known) return;
+	config.file_dev = st.st_dev;
+	config.file_ino = st.st_ino;
+	config.file_size = st.st_size;
+	config.file_mtime = st.st_mtim;
+}
+
+int editorFileChanged() {
+	struct stat st;
+	if (!config.file_known) return 0;
+	// a deleted file is not a conflict, saving just recreates it
+	if (stat(config.filename, &st) == -1) return 0;
+	return st.st_dev != config.file_dev || st.st_ino != config.file_ino ||
+	       st.st_size != config.file_size ||
+	       st.st_mtim.tv_sec != config.file_mtime.tv_sec ||
+	       st.st_mtim.tv_nsec != config.file_mtime.tv_nsec;
+}
+
+// splits the next line out of a mapped file the same way editorOpen does
+size_t editorNextLine(const char *data, size_t len, size_t off, size_t *next) {
+	const char *nl = memchr(&data[off], '\n', len - off);
+	size_t end = nl ? (size_t) (nl - data) : len;
+	*next = nl ? end + 1 : len;
+	while (end > off && data[end - 1] == '\r') end--;
+	return end - off;
+}
+
+// greedy O(ND) diff over line hashes. fills keep[j] with the old row
+// matched to new line j (or -1), fails once more than maxd edits are needed.
+int editorDiffHashes(uint64_t *a, int n, uint64_t *b, int m, int *keep, int maxd) {
+	int width = 2 * maxd + 3;
+	int off = maxd + 1;
+	int *trace = malloc(sizeof(int) * width * (maxd + 1));
+	int *v = malloc(sizeof(int) * width);
+	int d, k, x, y, found = -1;
+
+	for (y = 0; y < m; y++) keep[y] = -1;
+	v[off + 1] = 0;
+	for (d = 0; d <= maxd && found == -1; d++) {
+		for (k = -d; k <= d; k += 2) {
+			if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+				x = v[off + k + 1];
+			else
+				x = v[off + k - 1] + 1;
+			y = x - k;
+			while (x < n && y < m && a[x] == b[y]) {
+				x++;
+				y++;
+			}
+			v[off + k] = x;
+			if (x >= n && y >= m) {
+				found = d;
+				break;
+			}
+		}
+		memcpy(&trace[d * width], v, sizeof(int) * width);
+	}
+
+	if (found != -1) {
+		// walk the trace backwards recording the diagonal runs
+		x = n;
+		y = m;
+		for (d = found; d > 0; d--) {
+			int *pv = &trace[(d - 1) * width];
+			k = x - y;
+			int pk = (k == -d || (k != d && pv[off + k - 1] < pv[off + k + 1])) ? k + 1 : k - 1;
+			int px = pv[off + pk];
+			int py = px - pk;
+			while (x > px && y > py) keep[--y] = --x;
+			x = px;
+			y = py;
+		}
+		while (x > 0 && y > 0) keep[--y] = --x;
+	}
+
+	free(trace);
+	free(v);
+	return found;
+}
+
+// re-reads filename, replacing only rows whose contents differ on disk
+void editorReloadFile() {
+	int fd = open(config.filename, O_RDONLY);
+	if (fd == -1) {
+		editorSetMessage("Can't reload! I/O error: %s", strerror(errno));
+		return;
+	}
+	struct stat st;
+	char *data = NULL;
+	size_t len = 0;
+	// an unreadable size must not pass for an empty file
+	if (fstat(fd, &st) == -1) {
+		editorSetMessage("Can't reload! I/O error: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+	if (st.st_size > 0) {
+		len = st.st_size;
+		data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		editorSetMessage("Can't reload! I/O error: %s", strerror(errno));
+		return;
+	}
+
+	// skip the unchanged head of the file
+	int p = 0;
+	size_t poff = 0, next, llen;
+	while (p < config.numrows && poff < len) {
+		llen = editorNextLine(data, len, poff, &next);
+		if ((int) llen != config.row[p].size ||
+		    editorHashBytes(&data[poff], llen) != config.row[p].hash) break;
+		p++;
+		poff = next;
+	}
+
+	// and the unchanged tail, walking lines backwards from the end
+	int q = 0;
+	size_t soff = len;
+	size_t e = (len > 0 && data[len - 1] == '\n') ? len - 1 : len;
+	while (q < config.numrows - p && soff > poff) {
+		const char *nl = memrchr(data, '\n', e);
+		size_t start = nl ? (size_t) (nl - data) + 1 : 0;
+		if (start < poff) break;
+		size_t end = e;
+		while (end > start && data[end - 1] == '\r') end--;
+		erow *row = &config.row[config.numrows - 1 - q];
+		if ((int) (end - start) != row->size ||
+		    editorHashBytes(&data[start], end - start) != row->hash) break;
+		q++;
+		soff = start;
+		if (start == 0) break;
+		e = start - 1;
+	}
+
+	// collect the changed span on both sides
+	int n = config.numrows - p - q;
+	int m = 0;
+	size_t o;
+	for (o = poff; o < soff; o = next) {
+		editorNextLine(data, soff, o, &next);
+		m++;
+	}
+	size_t *loff = malloc(sizeof(size_t) * (m + 1));
+	int *lsize = malloc(sizeof(int) * (m + 1));
+	uint64_t *lhash = malloc(sizeof(uint64_t) * (m + 1));
+	uint64_t *rhash = malloc(sizeof(uint64_t) * (n + 1));
+	int *keep = malloc(sizeof(int) * (m + 1));
+	int j = 0;
+	for (o = poff; o < soff; o = next, j++) {
+		loff[j] = o;
+		lsize[j] = editorNextLine(data, soff, o, &next);
+		lhash[j] = editorHashBytes(&data[o], lsize[j]);
+	}
+	for (j = 0; j < n; j++) rhash[j] = config.row[p + j].hash;
+	editorDiffHashes(rhash, n, lhash, m, keep, RELOAD_MAX_EDITS);
+
+	// rebuild the row array in one pass, moving kept rows and freeing the rest
+	int numrows = p + m + q;
+	erow *rows = memRealloc(MEM_ROWS, NULL, 0, sizeof(erow) * (numrows + 1));
+	unsigned char *trans = memRealloc(MEM_SYNTAX, NULL, 0, numrows + 1);
+	unsigned char *state = memRealloc(MEM_SYNTAX, NULL, 0, numrows + 1);
+	char *used = calloc(n + 1, 1);
+	int cy = -1;
+	memcpy(rows, config.row, sizeof(erow) * p);
+	memcpy(trans, config.hl_trans, p);
+	memcpy(state, config.hl_state, p);
+	for (j = 0; j < m; j++) {
+		if (keep[j] != -1) {
+			rows[p + j] = config.row[p + keep[j]];
+			trans[p + j] = config.hl_trans[p + keep[j]];
+			used[keep[j]] = 1;
+			if (cy == -1 && p + keep[j] >= config.cy) cy = p + j;
+		} else {
+			editorInitRow(&rows[p + j], p + j, &data[loff[j]], lsize[j]);
+			trans[p + j] = 0xff;
+		}
+	}
+	for (j = 0; j < n; j++)
+		if (!used[j]) editorFreeRow(&config.row[p + j]);
+	memcpy(&rows[p + m], &config.row[p + n], sizeof(erow) * q);
+	memcpy(&trans[p + m], &config.hl_trans[p + n], q);
+
+	if (config.cy < p) cy = config.cy;
+	else if (config.cy >= p + n) cy = config.cy - n + m;
+	else if (cy == -1) cy = p + m;
+	memFree(MEM_ROWS, config.row, sizeof(erow) * config.rowcap);
+	editorSyntaxResize(config.rowcap, 0);
+	config.row = rows;
+	config.hl_trans = trans;
+	config.hl_state = state;
+	config.rowcap = numrows + 1;
+	config.numrows = numrows;
+	for (j = p; j < numrows; j++) config.row[j].idx = j;
+
+	// every state below the head is recomputed from the kept transitions
+	editorSyntaxInvalidate(p, numrows);
+	brackets.stale = 1;
+	fenwickInvalidate(&config.offsets, p);
+	fenwickInvalidate(&config.layout, p);
+	for (j = 0; j < m; j++)
+		if (keep[j] == -1) editorUpdateRow(&config.row[p + j]);
+
+	free(loff);
+	free(lsize);
+	free(lhash);
+	free(rhash);
+	free(keep);
+	free(used);
+	if (data) munmap(data, len);
+
+	config.rowoff += cy - config.cy;
+	if (config.rowoff < 0) config.rowoff = 0;
+	config.cy = cy;
+	if (config.cy > config.numrows) config.cy = config.numrows;
+	if (config.cy < config.numrows && config.cx > config.row[config.cy].size)
+		config.cx = config.row[config.cy].size;
+	config.dirty = 0;
+	editorRecordFileStat();
+	editorGutterRebase();
+}
+
+// polled from the main loop, at most once a second
+void editorCheckFileChanged() {
+	time_t now = time(NULL);
+	if (now == config.file_checked) return;
+	config.file_checked = now;
+
+	if (config.file_conflict || !editorFileChanged()) return;
+	if (config.dirty) {
+		config.file_conflict = 1;
+		editorSetMessage("WARNING! %.20s changed on disk. Saving will ask before overwriting.",
+			config.filename);
+		return;
+	}
+	editorReloadFile();
+	editorSetMessage("%.20s changed on disk, reloaded", config.filename);
+}
+
 /*** find ***/
 
 void editorFindCallback(char *query, int key) {
@@ -685,7 +3689,7 @@ void editorFindCallback(char *query, int key) {
 
 	if (saved_hl) {
 		memcpy(config.row[saved_hl_line].hl, saved_hl, config.row[saved_hl_line].rsize);
-		free(saved_hl);
+		memFree(MEM_SEARCH, saved_hl, config.row[saved_hl_line].rsize);
 		saved_hl = NULL;
 	}
 
@@ -704,6 +3708,7 @@ void editorFindCallback(char *query, int key) {
 
 	if (last_match == -1) direction = 1;
 	int current = last_match;
+	int narrowed = editorTrigramCandidates(query);
 
 	// search rows for term
 	int i;
@@ -712,16 +3717,42 @@ void editorFindCallback(char *query, int key) {
 		if (current == -1) current = config.numrows - 1;
 		else if (current == config.numrows) current = 0;
 
+		if (narrowed) {
+			// rows in blocks the index rules out are skipped as a whole
+			int next = editorTrigramNext(current, direction);
+			int to = next != -1 ? next : direction > 0 ? config.numrows - 1 : 0;
+			i += abs(to - current);
+			current = to;
+			if (next == -1) continue;
+		}
+
 		erow *row = &config.row[current];
-		char *match = strstr(row->render, query);
+		if (row->cold) {
+			// a match not in the bytes needs a space from an expanded tab
+			const char *data = editorRowData(row);
+			if (!memmem(data, row->size, query, strlen(query)) &&
+			    (!strchr(query, ' ') || !memchr(data, '\t', row->size)))
+				continue;
+		}
+		// packed rows are searched in their render text and unpacked on a match
+		int rsize;
+		char *render = editorRowRender(row, &rsize);
+		char *match = strstr(render, query);
+		if (match && row->cold) {
+			int off = match - render;
+			editorRowThaw(row);
+			match = &row->render[off];
+		}
 		if (match) {
 			last_match = current;
 			config.cy = current;
-			config.cx = editorRowRxToCx(row, match - row->render);
+			config.cx = editorRowRenderToCx(row, match - row->render);
 			config.rowoff = config.numrows;
 
 			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
+			// the match colour goes over up to date syntax, not a stale copy
+			editorRowEnsureSyntax(row);
+			saved_hl = memRealloc(MEM_SEARCH, NULL, 0, row->rsize);
 			memcpy(saved_hl, row->hl, row->rsize);
 			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
 			break;
@@ -734,6 +3765,7 @@ void editorFind() {
 	int saved_cy = config.cy;
 	int saved_coloff = config.coloff;
 	int saved_rowoff = config.rowoff;
+	int saved_wrapoff = config.wrapoff;
 
 	// prompt user for search term
 	char *query = editorPrompt("Search: %s_ (ESC to cancel)", editorFindCallback);
@@ -744,7 +3776,831 @@ void editorFind() {
 		config.cy = saved_cy;
 		config.rowoff = saved_rowoff;
 		config.coloff = saved_coloff;
+		config.wrapoff = saved_wrapoff;
+	}
+}
+
+/*** goto ***/
+
+// accepts a line number, or a byte offset as @123 or 0x7b
+void editorGoto() {
+	char *answer = editorPrompt("Go to: %s (line, @offset or 0xoffset, ESC to cancel)", NULL);
+	if (answer == NULL) return;
+
+	char *p = answer, *end;
+	int offset = 0;
+	if (*p == '@') {
+		offset = 1;
+		p++;
+	} else if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		offset = 1;
+	}
+	// decimal unless marked hex, so a leading zero is not read as octal
+	int hex = p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+	errno = 0;
+	long long n = strtoll(p, &end, hex ? 16 : 10);
+	if (end == p || *end != '\0' || errno || n < 0 || (!offset && n == 0)) {
+		editorSetMessage("Not a line or offset: %s", answer);
+		free(answer);
+		return;
+	}
+	free(answer);
+
+	if (offset) {
+		long long rem;
+		int at = fenwickFind(&config.offsets, n, &rem);
+		if (at >= config.numrows) {
+			editorSetMessage("Offset %lld is past the end of the file", n);
+			return;
+		}
+		// an offset on the newline lands at the end of the line
+		config.cy = at;
+		editorRowThaw(&config.row[at]);
+		config.cx = editorRowSnapCx(&config.row[at], rem);
+	} else {
+		config.cy = n > config.numrows ? config.numrows - 1 : n - 1;
+		config.cx = 0;
+	}
+	if (config.cy < 0) config.cy = 0;
+	// scrolls the target line to the top, as find does
+	if (config.cy < config.rowoff || config.cy >= config.rowoff + config.screenrows)
+		config.rowoff = config.numrows;
+}
+
+/*** replace ***/
+
+/*
+ * replaces every match starting at or after from (and before until, unless
+ * it is -1) in a single pass over the row, rendering it once at the end.
+ * returns the number of replacements.
+ */
+int editorRowReplace(erow *row, const char *query, int qlen, const char *with, int wlen,
+                     int from, int until, int max) {
+	int count = 0, at = from;
+	const char *data = editorRowData(row);
+	char *m;
+	while ((max < 0 || count < max) && at <= row->size - qlen &&
+	       (m = memmem(&data[at], row->size - at, query, qlen)) &&
+	       (until < 0 || m - data < until)) {
+		count++;
+		at = m - data + qlen;
+	}
+	if (count == 0) return 0;
+	editorRowThaw(row);
+	editorRowWordsAround(row, 0, row->size, -1);
+
+	int size = row->size + count * (wlen - qlen);
+	char *chars = memRealloc(MEM_CHARS, NULL, 0, size + 1);
+	char *p = chars;
+	int done = 0;
+	memcpy(p, row->chars, from);
+	p += from;
+	at = from;
+	while (done < count) {
+		m = memmem(&row->chars[at], row->size - at, query, qlen);
+		memcpy(p, &row->chars[at], m - &row->chars[at]);
+		p += m - &row->chars[at];
+		memcpy(p, with, wlen);
+		p += wlen;
+		at = m - row->chars + qlen;
+		done++;
+	}
+	memcpy(p, &row->chars[at], row->size - at);
+	chars[size] = '\0';
+
+	memFree(MEM_CHARS, row->chars, row->size + 1);
+	row->chars = chars;
+	row->size = size;
+	editorUpdateRow(row);
+	editorRowWordsAround(row, 0, row->size, 1);
+	return count;
+}
+
+// asks about each match from the cursor on, wrapping once; 'a' does the rest in bulk
+void editorReplace() {
+	char *query = editorPrompt("Replace: %s_ (ESC to cancel)", NULL);
+	if (query == NULL) return;
+	char *with = editorPromptWith("Replace with: %s_ (ESC to cancel)", NULL, 1);
+	if (with == NULL) {
+		free(query);
+		return;
+	}
+
+	int qlen = strlen(query), wlen = strlen(with);
+	int start_y = config.cy, start_x = config.cx;
+	int y = config.cy, x = config.cx;
+	int wrapped = 0, all = 0, replaced = 0, stop = 0;
+
+	while (!stop) {
+		if (y >= config.numrows) {
+			if (wrapped) break;
+			wrapped = 1;
+			y = x = 0;
+			continue;
+		}
+		if (wrapped && y > start_y) break;
+		// back on the starting row, only matches before the cursor are left
+		int until = (wrapped && y == start_y) ? start_x : -1;
+		erow *row = &config.row[y];
+
+		if (all) {
+			replaced += editorRowReplace(row, query, qlen, with, wlen, x, until, -1);
+			y++;
+			x = 0;
+			continue;
+		}
+
+		const char *data = editorRowData(row);
+		char *m = (x <= row->size - qlen) ? memmem(&data[x], row->size - x, query, qlen) : NULL;
+		if (m == NULL || (until >= 0 && m - data >= until)) {
+			y++;
+			x = 0;
+			continue;
+		}
+
+		int at = m - data;
+		config.cy = y;
+		config.cx = at;
+		editorRowEnsureSyntax(row);
+		int rx = editorRowCxToRender(row, at);
+		int rlen = editorRowCxToRender(row, at + qlen) - rx;
+		unsigned char *saved_hl = memRealloc(MEM_SEARCH, NULL, 0, row->rsize);
+		memcpy(saved_hl, row->hl, row->rsize);
+		memset(&row->hl[rx], HL_MATCH, rlen);
+		editorSetMessage("Replace this match? (y)es (n)o (a)ll, ESC to stop");
+		editorRefreshScreen();
+		int c = editorReadKey();
+		memcpy(row->hl, saved_hl, row->rsize);
+		memFree(MEM_SEARCH, saved_hl, row->rsize);
+
+		switch (c) {
+			case 'y':
+				replaced += editorRowReplace(row, query, qlen, with, wlen, at, -1, 1);
+				x = at + wlen;
+				break;
+			case 'n':
+				x = at + 1;
+				break;
+			case 'a':
+				all = 1;
+				x = at;
+				break;
+			default:
+				stop = 1;
+				break;
+		}
 	}
+
+	if (replaced) config.dirty++;
+	if (config.cy < config.numrows && config.cx > config.row[config.cy].size)
+		config.cx = config.row[config.cy].size;
+	editorSetMessage("Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
+	free(query);
+	free(with);
+}
+
+/*** completion ***/
+
+void editorCompleteReset() {
+	for (int j = 0; j < complete.n; j++) free(complete.cands[j]);
+	complete.n = 0;
+}
+
+// keeps the COMPLETE_MAX most frequent words starting with prefix
+void editorCompleteGather(const char *prefix, int plen) {
+	int counts[COMPLETE_MAX];
+	struct wordEntry *best[COMPLETE_MAX];
+	int n = 0;
+	editorCompleteReset();
+	if (!words.cap) return;
+
+	// a one byte prefix covers all 256 chains starting with it
+	int first = (unsigned char) prefix[0] << 8, last = first + 255;
+	if (plen > 1) first = last = wordsBucket(prefix);
+	for (int b = first; b <= last; b++) {
+		for (int i = words.heads[b]; i != -1; i = words.table[i].next) {
+			struct wordEntry *e = &words.table[i];
+			if (e->len <= plen || memcmp(e->word, prefix, plen)) continue;
+			// insertion into the sorted list, ties go to the shorter word
+			int k = n < COMPLETE_MAX ? n++ : COMPLETE_MAX;
+			while (k > 0 && (counts[k - 1] < e->count ||
+			       (counts[k - 1] == e->count && best[k - 1]->len > e->len))) {
+				if (k < COMPLETE_MAX) {
+					counts[k] = counts[k - 1];
+					best[k] = best[k - 1];
+				}
+				k--;
+			}
+			if (k < COMPLETE_MAX) {
+				counts[k] = e->count;
+				best[k] = e;
+			}
+		}
+	}
+	for (int j = 0; j < n; j++) {
+		complete.cands[j] = malloc(best[j]->len + 1);
+		memcpy(complete.cands[j], best[j]->word, best[j]->len);
+		complete.cands[j][best[j]->len] = '\0';
+	}
+	complete.n = n;
+}
+
+/*
+ * completes the word before the cursor from the buffer's word index.
+ * pressing the key again right away cycles through the other candidates.
+ */
+void editorComplete() {
+	if (config.cy >= config.numrows) return;
+	erow *row = &config.row[config.cy];
+	editorRowThaw(row);
+
+	int again = complete.n > 0 && complete.clock + 1 == cold.clock && complete.cy == config.cy &&
+		config.cx == complete.cx + complete.inserted;
+	if (again) {
+		// take the previous candidate back out
+		while (config.cx > complete.cx) {
+			config.cx = editorRowPrevChar(row, config.cx);
+			editorRowDelChar(row, config.cx);
+		}
+		complete.pick = (complete.pick + 1) % complete.n;
+	} else {
+		int start = config.cx;
+		while (start > 0 && editorIsWordChar((unsigned char) row->chars[start - 1])) start--;
+		if (start == config.cx) {
+			editorSetMessage("Nothing to complete");
+			return;
+		}
+		// right after opening a file the index may still be filling in
+		editorIndexRows(config.numrows);
+		int plen = config.cx - start;
+		char *prefix = malloc(plen);
+		memcpy(prefix, &row->chars[start], plen);
+		editorCompleteGather(prefix, plen);
+		free(prefix);
+		complete.pick = 0;
+		complete.cy = config.cy;
+		complete.cx = config.cx;
+		complete.inserted = 0;
+		if (complete.n == 0) {
+			editorSetMessage("No completions");
+			return;
+		}
+	}
+	complete.clock = cold.clock;
+
+	char *cand = complete.cands[complete.pick];
+	int plen = 0;
+	// the prefix is what precedes the insertion point within the candidate
+	while (complete.cx - plen > 0 && editorIsWordChar((unsigned char) row->chars[complete.cx - plen - 1]))
+		plen++;
+	int len = strlen(cand) - plen;
+	for (int j = 0; j < len; j++) editorInsertChar(cand[plen + j]);
+	complete.inserted = len;
+	editorSetMessage("Completion %d/%d: %s", complete.pick + 1, complete.n, cand);
+}
+
+/*** sort ***/
+
+// the first 8 bytes big-endian, so lexical order mostly needs no memcmp
+uint64_t sortPrefixKey(const char *s, int len) {
+	uint64_t key = 0;
+	for (int j = 0; j < 8; j++) key = key << 8 | (j < len ? (unsigned char) s[j] : 0);
+	return key;
+}
+
+// the leading number as sort -n reads it, mapped so integer order is numeric order
+uint64_t sortNumberKey(const char *s, int len) {
+	char buf[64];
+	int j = 0, start, n = 0;
+	while (j < len && (s[j] == ' ' || s[j] == '\t')) j++;
+	start = j;
+	if (j < len && s[j] == '-') j++;
+	while (j < len && (isdigit((unsigned char) s[j]) || s[j] == '.') && j - start < (int) sizeof(buf) - 1) j++;
+	for (n = 0; start + n < j; n++) buf[n] = s[start + n];
+	buf[n] = '\0';
+	double v = strtod(buf, NULL);
+	if (v == 0) v = 0;
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return bits >> 63 ? ~bits : bits | 1ULL << 63;
+}
+
+int sortCompare(const struct sortItem *a, const struct sortItem *b) {
+	int c = (a->key > b->key) - (a->key < b->key);
+	// like sort -nu, equal numbers stay in input order so the first is kept
+	if (c == 0 && !(sorter.numeric && sorter.unique)) {
+		// numbers tie on the whole line, prefixes only on what follows them
+		const erow *x = a->row, *y = b->row;
+		int skip = sorter.numeric ? 0 : 8;
+		int xs = x->size < skip ? x->size : skip, ys = y->size < skip ? y->size : skip;
+		int xl = x->size - xs, yl = y->size - ys;
+		c = memcmp(a->data + xs, b->data + ys, xl < yl ? xl : yl);
+		if (c == 0) c = (xl > yl) - (xl < yl);
+	}
+	return sorter.reverse ? -c : c;
+}
+
+// stable: on ties x comes first
+void sortMerge(const struct sortItem *x, int nx, const struct sortItem *y, int ny, struct sortItem *out) {
+	int i = 0, j = 0;
+	while (i < nx && j < ny) *out++ = sortCompare(&y[j], &x[i]) < 0 ? y[j++] : x[i++];
+	memcpy(out, &x[i], sizeof(*out) * (nx - i));
+	memcpy(out + nx - i, &y[j], sizeof(*out) * (ny - j));
+}
+
+void sortRun(struct sortItem *a, struct sortItem *tmp, int n) {
+	if (n <= 24) {
+		for (int i = 1; i < n; i++) {
+			struct sortItem it = a[i];
+			int j = i;
+			for (; j > 0 && sortCompare(&it, &a[j - 1]) < 0; j--) a[j] = a[j - 1];
+			a[j] = it;
+		}
+		return;
+	}
+	int h = n / 2;
+	sortRun(a, tmp, h);
+	sortRun(a + h, tmp + h, n - h);
+	if (sortCompare(&a[h - 1], &a[h]) <= 0) return;
+	memcpy(tmp, a, sizeof(*a) * h);
+	sortMerge(tmp, h, a + h, n - h, a);
+}
+
+// how many of the first k merged items come from x
+int sortCorank(int k, const struct sortItem *x, int nx, const struct sortItem *y, int ny) {
+	int lo = k > ny ? k - ny : 0, hi = k < nx ? k : nx;
+	while (lo < hi) {
+		int i = (lo + hi) / 2, j = k - i;
+		if (j > 0 && sortCompare(&x[i], &y[j - 1]) <= 0) lo = i + 1;
+		else hi = i;
+	}
+	return lo;
+}
+
+void *sortWorker(void *arg) {
+	struct sortTask *t = arg;
+	if (t->x) sortMerge(t->x, t->nx, t->y, t->ny, t->out);
+	else sortRun(t->a, t->tmp, t->n);
+	return NULL;
+}
+
+void sortParallel(struct sortTask *tasks, int n) {
+	pthread_t threads[SORT_THREADS];
+	int started = 0;
+	for (int j = 1; j < n; j++)
+		if (pthread_create(&threads[j], NULL, sortWorker, &tasks[j]) == 0) started |= 1 << j;
+		else sortWorker(&tasks[j]);
+	sortWorker(&tasks[0]);
+	for (int j = 1; j < n; j++)
+		if (started & 1 << j) pthread_join(threads[j], NULL);
+}
+
+/*
+ * stable merge sort over threads: each sorts a run, then pairs of runs are
+ * merged in rounds with every merge split between the threads it frees up.
+ * returns the buffer holding the result, a or tmp.
+ */
+struct sortItem *sortItems(struct sortItem *a, struct sortItem *tmp, int n, int threads) {
+	struct sortTask tasks[SORT_THREADS];
+	int runs = threads;
+	for (int j = 0; j < runs; j++) {
+		int lo = (long long) n * j / runs, hi = (long long) n * (j + 1) / runs;
+		tasks[j] = (struct sortTask) { .a = a + lo, .tmp = tmp + lo, .n = hi - lo };
+	}
+	sortParallel(tasks, runs);
+
+	struct sortItem *src = a, *dst = tmp;
+	for (; runs > 1; runs /= 2) {
+		int parts = threads / (runs / 2), t = 0;
+		for (int r = 0; r < runs; r += 2) {
+			int lo = (long long) n * r / runs, mid = (long long) n * (r + 1) / runs;
+			int hi = (long long) n * (r + 2) / runs;
+			const struct sortItem *x = src + lo, *y = src + mid;
+			int nx = mid - lo, ny = hi - mid;
+			for (int p = 0; p < parts; p++) {
+				int k0 = (long long) (nx + ny) * p / parts, k1 = (long long) (nx + ny) * (p + 1) / parts;
+				int i0 = sortCorank(k0, x, nx, y, ny), i1 = sortCorank(k1, x, nx, y, ny);
+				tasks[t++] = (struct sortTask) { .x = x + i0, .nx = i1 - i0, .y = y + k0 - i0,
+					.ny = (k1 - i1) - (k0 - i0), .out = dst + lo + k0 };
+			}
+		}
+		sortParallel(tasks, t);
+		struct sortItem *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	return src;
+}
+
+/*
+ * text of a row to sort without thawing it. the shared cold cache holds a
+ * single block and is not safe across threads, so each block the rows use
+ * is decoded into a table of its own, kept until the sort is done.
+ */
+const char *sortRowData(struct sortBlocks *sb, erow *row) {
+	if (!row->cold) return row->chars;
+	if (2 * (sb->len + 1) > sb->cap) {
+		struct sortBlocks grown = { NULL, NULL, 0, sb->cap ? sb->cap * 2 : 64 };
+		grown.block = calloc(grown.cap, sizeof(*grown.block));
+		grown.raw = malloc(sizeof(*grown.raw) * grown.cap);
+		for (int j = 0; j < sb->cap; j++) {
+			if (!sb->block[j]) continue;
+			unsigned h = ((uintptr_t) sb->block[j] >> 4) & (grown.cap - 1);
+			while (grown.block[h]) h = (h + 1) & (grown.cap - 1);
+			grown.block[h] = sb->block[j];
+			grown.raw[h] = sb->raw[j];
+		}
+		grown.len = sb->len;
+		free(sb->block);
+		free(sb->raw);
+		*sb = grown;
+	}
+	unsigned h = ((uintptr_t) row->cold >> 4) & (sb->cap - 1);
+	while (sb->block[h] && sb->block[h] != row->cold) h = (h + 1) & (sb->cap - 1);
+	if (!sb->block[h]) {
+		sb->block[h] = row->cold;
+		sb->raw[h] = malloc(row->cold->rawlen);
+		coldDecompress(row->cold->data, row->cold->len, sb->raw[h], row->cold->rawlen);
+		sb->len++;
+	}
+	return &sb->raw[h][row->cold_off];
+}
+
+void sortBlocksFree(struct sortBlocks *sb) {
+	for (int j = 0; j < sb->cap; j++)
+		if (sb->block[j]) free(sb->raw[j]);
+	free(sb->block);
+	free(sb->raw);
+}
+
+/*
+ * sorts rows start to end - 1, or with dedupe only drops lines equal to
+ * the one before. rows are permuted as whole erow entries, their text is
+ * never copied and packed rows stay packed. returns the number of rows
+ * removed as duplicates.
+ */
+int editorSortRows(int start, int end, int dedupe, int *threads_used) {
+	int n = end - start, j;
+	struct sortItem *items = malloc(sizeof(*items) * n), *tmp = malloc(sizeof(*items) * n);
+	int *tri = malloc(sizeof(int) * n), *base = malloc(sizeof(int) * n);
+	unsigned char *trans = malloc(n);
+	struct sortBlocks blocks = { NULL, NULL, 0, 0 };
+	for (j = 0; j < n; j++) {
+		erow *row = &config.row[start + j];
+		const char *data = sortRowData(&blocks, row);
+		items[j].key = sorter.numeric ? sortNumberKey(data, row->size) : sortPrefixKey(data, row->size);
+		items[j].row = row;
+		items[j].data = data;
+		tri[j] = row->tri;
+		base[j] = row->base;
+	}
+
+	int threads = 1;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	while (threads * 2 <= ncpu && threads * 2 <= SORT_THREADS && n / (threads * 2) >= SORT_MIN_RUN)
+		threads *= 2;
+	struct sortItem *sorted = items;
+	if (!dedupe) sorted = sortItems(items, tmp, n, threads);
+	*threads_used = dedupe ? 1 : threads;
+
+	// the rows are moved through a copy, then duplicates after the first are freed
+	erow *rows = malloc(sizeof(erow) * n);
+	const char **data = malloc(sizeof(*data) * n);
+	struct sortItem last;
+	int kept = 0;
+	for (j = 0; j < n; j++) {
+		erow *row = sorted[j].row;
+		if (kept && (sorter.unique || dedupe)) {
+			int same = dedupe ? last.row->size == row->size && !memcmp(last.data, sorted[j].data, row->size)
+			                  : sortCompare(&last, &sorted[j]) == 0;
+			if (same) {
+				editorFreeRow(row);
+				continue;
+			}
+		}
+		trans[kept] = config.hl_trans[row->idx];
+		data[kept] = sorted[j].data;
+		rows[kept] = *row;
+		last = (struct sortItem) { sorted[j].key, &rows[kept++], sorted[j].data };
+	}
+	memcpy(&config.row[start], rows, sizeof(erow) * kept);
+	memcpy(&config.hl_trans[start], trans, kept);
+	// packed rows are packed again in their new order, or reading the range
+	// through would decode a whole block for nearly every row
+	for (j = start; j < start + kept; ) {
+		int end = j, bytes = 0;
+		while (end < start + kept && end - j < COLD_BLOCK_ROWS && bytes < COLD_BLOCK_BYTES &&
+		       config.row[end].cold)
+			bytes += config.row[end++].size;
+		if (end > j) editorFreezeBlock(j, end, &data[j - start]);
+		else end = j + 1;
+		j = end;
+	}
+
+	int removed = n - kept;
+	if (removed) {
+		memmove(&config.row[start + kept], &config.row[end], sizeof(erow) * (config.numrows - end));
+		memmove(&config.hl_trans[start + kept], &config.hl_trans[end], config.numrows - end);
+		memmove(&config.hl_state[start + kept], &config.hl_state[end], config.numrows - end);
+		config.numrows -= removed;
+		if (config.hl_dirty > end) config.hl_dirty -= removed;
+		else if (config.hl_dirty > start + kept) config.hl_dirty = start + kept;
+	}
+	// block ids and saved lines stay with positions so they keep ascending,
+	// deduped rows are still in order and keep their own saved lines
+	for (j = start; j < config.numrows; j++) {
+		erow *row = &config.row[j];
+		row->idx = j;
+		if (j < start + kept) {
+			row->tri = tri[j - start];
+			if (!dedupe) row->base = base[j - start];
+			editorTrigramRowChanged(row);
+		}
+	}
+
+	editorSyntaxInvalidate(start, start + kept);
+	brackets.stale = 1;
+	fenwickInvalidate(&config.offsets, start);
+	fenwickInvalidate(&config.layout, start);
+	editorCompleteReset();
+	config.dirty++;
+	sortBlocksFree(&blocks);
+	free(items);
+	free(tmp);
+	free(tri);
+	free(base);
+	free(trans);
+	free(rows);
+	free(data);
+	return removed;
+}
+
+/*
+ * sort prompt: n numeric, r reverse, u unique, d drop repeated lines
+ * without sorting, then optionally a line range like 10-200
+ */
+void editorSort() {
+	char *answer = editorPromptWith("Sort: %s (n numeric, r reverse, u unique, d dedupe only, "
+		"then A-B for lines, ESC to cancel)", NULL, 1);
+	if (answer == NULL) return;
+	int dedupe = 0, first = 1, last = config.numrows;
+	char *p = answer;
+	memset(&sorter, 0, sizeof(sorter));
+	for (; *p && !isdigit((unsigned char) *p) && *p != '-'; p++) {
+		if (*p == 'n') sorter.numeric = 1;
+		else if (*p == 'r') sorter.reverse = 1;
+		else if (*p == 'u') sorter.unique = 1;
+		else if (*p == 'd') dedupe = 1;
+		else if (*p != ' ') {
+			editorSetMessage("Unknown sort option %c", *p);
+			free(answer);
+			return;
+		}
+	}
+	if (*p) {
+		char *end;
+		if (*p != '-') first = strtol(p, &end, 10), p = end;
+		if (*p == '-') {
+			p++;
+			if (*p) last = strtol(p, &end, 10), p = end;
+		} else {
+			last = first;
+		}
+	}
+	int bad = *p || first < 1 || last > config.numrows || first > last;
+	free(answer);
+	if (bad) {
+		editorSetMessage("Bad line range, 1-%d", config.numrows);
+		return;
+	}
+
+	long long t = editorNow();
+	int threads, removed = editorSortRows(first - 1, last, dedupe, &threads);
+	if (config.cy > config.numrows) config.cy = config.numrows;
+	if (config.cy >= first - 1 && config.cy < last) config.cx = 0;
+	editorSetMessage("%s %d lines in %lld ms on %d thread%s, %d duplicates removed",
+		dedupe ? "Deduped" : "Sorted", last - first + 1, (editorNow() - t) / 1000,
+		threads, threads > 1 ? "s" : "", removed);
+}
+
+/*** buffers ***/
+
+// terminal and session state that stays put when buffers are switched
+void editorBufferKeepSession(struct editorConfig *to, const struct editorConfig *from) {
+	to->orig_termios = from->orig_termios;
+	to->screenrows = from->screenrows;
+	to->screencols = from->screencols;
+	memcpy(to->statusmsg, from->statusmsg, sizeof(to->statusmsg));
+	to->statusmsg_time = from->statusmsg_time;
+	to->hl_defer = from->hl_defer;
+	to->client = from->client;
+	to->headless = from->headless;
+	to->keys = from->keys;
+	to->keys_len = from->keys_len;
+	to->keys_pos = from->keys_pos;
+	to->keys_cap = from->keys_cap;
+	to->sink = from->sink;
+	to->sinklen = from->sinklen;
+	to->sink_total = from->sink_total;
+	to->frame_interval = from->frame_interval;
+	to->frame_last = from->frame_last;
+	to->trigrams = from->trigrams;
+	to->gutter = from->gutter;
+}
+
+void editorBufferStash() {
+	struct editorBuffer *b = &buffers.list[buffers.current];
+	b->config = config;
+	b->words = words;
+	b->brackets = brackets;
+	b->trigrams = trigrams;
+}
+
+// makes buffer at the one the editor works on, as it was stashed
+void editorBufferRestore(int at) {
+	struct editorBuffer *b = &buffers.list[at];
+	struct editorConfig session = config;
+	config = b->config;
+	int cols = editorTextCols();
+	editorBufferKeepSession(&config, &session);
+	// the gutter was turned on or off while the buffer was hidden
+	if (editorTextCols() != cols) fenwickInvalidate(&config.layout, 0);
+	words = b->words;
+	brackets = b->brackets;
+	brackets.match_row = -1;
+	trigrams = b->trigrams;
+	buffers.current = at;
+	cold.scan = 0;
+	cold.idle = 0;
+	editorCompleteReset();
+}
+
+// opens filename into the shown buffer, which starts empty if it does not exist
+void editorBufferOpen(const char *filename) {
+	if (access(filename, F_OK) == 0) {
+		editorOpen((char *) filename);
+		return;
+	}
+	config.filename = strdup(filename);
+	editorSelectSyntaxHighlight();
+	editorSetMessage("New file %s", filename);
+}
+
+// packs buffer at, or drops its rows if unload is set, then shows the old one again
+void editorBufferDemote(int at, int unload) {
+	int shown = buffers.current;
+	editorBufferStash();
+	editorBufferRestore(at);
+	if (unload) {
+		// the cursor and view stay, so the file reopens where it was left
+		char *filename = strdup(config.filename);
+		editorCloseFile();
+		config.filename = filename;
+		buffers.list[at].unloaded = 1;
+	} else {
+		editorFreezeAll();
+		fenwickFree(&config.offsets);
+		fenwickFree(&config.layout);
+		buffers.list[at].packed = 1;
+	}
+	editorBufferStash();
+	editorBufferRestore(shown);
+}
+
+/*
+ * keeps live memory under the budget by demoting hidden buffers, least
+ * recently shown first. packing goes before unloading, which has to
+ * reread and rehighlight the whole file on the next visit.
+ */
+void editorBuffersTrim() {
+	for (int unload = 0; unload < 2; unload++) {
+		while (memLive() > buffers.budget) {
+			int victim = -1;
+			for (int j = 0; j < buffers.len; j++) {
+				struct editorBuffer *b = &buffers.list[j];
+				if (j == buffers.current || b->unloaded) continue;
+				if (unload ? b->config.dirty || !b->config.filename : b->packed) continue;
+				if (victim == -1 || b->used < buffers.list[victim].used) victim = j;
+			}
+			if (victim == -1) break;
+			editorBufferDemote(victim, unload);
+		}
+	}
+}
+
+void editorBufferShow(int at) {
+	if (at == buffers.current) return;
+	editorBufferStash();
+	editorBufferRestore(at);
+	struct editorBuffer *b = &buffers.list[at];
+	b->used = ++buffers.clock;
+	b->packed = 0;
+	if (b->unloaded) {
+		b->unloaded = 0;
+		char *filename = config.filename;
+		config.filename = NULL;
+		editorBufferOpen(filename);
+		free(filename);
+		if (config.cy > config.numrows) config.cy = config.numrows;
+		config.cx = 0;
+	}
+	editorBuffersTrim();
+}
+
+/*
+ * adds a buffer for filename and shows it. a lazy one is only read from
+ * disk when it is first shown.
+ */
+void editorBufferAdd(const char *filename, int lazy) {
+	if (buffers.cap == 0) {
+		// the buffer shown so far becomes the first entry
+		buffers.list = memRealloc(MEM_ROWS, NULL, 0, sizeof(struct editorBuffer) * 4);
+		buffers.cap = 4;
+		memset(&buffers.list[0], 0, sizeof(struct editorBuffer));
+		buffers.list[0].used = ++buffers.clock;
+		buffers.len = 1;
+	}
+	if (buffers.len == buffers.cap) {
+		buffers.list = memRealloc(MEM_ROWS, buffers.list, sizeof(struct editorBuffer) * buffers.cap,
+			sizeof(struct editorBuffer) * buffers.cap * 2);
+		buffers.cap *= 2;
+	}
+	int shown = buffers.current, at = buffers.len++;
+	struct editorBuffer *b = &buffers.list[at];
+	memset(b, 0, sizeof(*b));
+	editorBufferStash();
+
+	// the stashed buffer keeps its rows and indexes, this one starts empty
+	editorInitBuffer();
+	memset(&words, 0, sizeof(words));
+	memset(&brackets, 0, sizeof(brackets));
+	brackets.match_row = -1;
+	memset(&trigrams, 0, sizeof(trigrams));
+	buffers.current = at;
+	editorCompleteReset();
+	if (lazy) {
+		config.filename = strdup(filename);
+		b->unloaded = 1;
+		editorBufferStash();
+		editorBufferRestore(shown);
+		return;
+	}
+	b->used = ++buffers.clock;
+	cold.scan = 0;
+	cold.idle = 0;
+	editorBufferOpen(filename);
+	editorBuffersTrim();
+}
+
+// shows the buffer for a file, opening it if no buffer has it yet
+/*
+ * buffer whose file is path, -1 if there is none. existing files are
+ * compared by device and inode, so any name for one finds its buffer.
+ */
+int editorBufferFind(const char *path) {
+	struct stat st, other;
+	int known = stat(path, &st) == 0;
+	for (int j = 0; j < (buffers.len ? buffers.len : 1); j++) {
+		const char *name = j == buffers.current ? config.filename : buffers.list[j].config.filename;
+		if (!name) continue;
+		if (known ? stat(name, &other) == 0 && other.st_dev == st.st_dev && other.st_ino == st.st_ino
+		          : !strcmp(name, path))
+			return j;
+	}
+	return -1;
+}
+
+void editorBufferPrompt() {
+	char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+	if (filename == NULL) return;
+	int at = editorBufferFind(filename);
+	if (at != -1) {
+		editorBufferShow(at);
+		free(filename);
+		return;
+	}
+	if (buffers.len == 0 && config.numrows == 0 && !config.dirty && !config.filename)
+		editorBufferOpen(filename);
+	else
+		editorBufferAdd(filename, 0);
+	free(filename);
+}
+
+void editorBufferNext() {
+	if (buffers.len < 2) {
+		editorSetMessage("No other buffers, Ctrl-O opens one");
+		return;
+	}
+	editorBufferShow((buffers.current + 1) % buffers.len);
+	editorSetMessage("Buffer %d/%d: %s", buffers.current + 1, buffers.len,
+		config.filename ? config.filename : "[No Name]");
+}
+
+int editorBuffersDirty() {
+	if (config.dirty) return 1;
+	for (int j = 0; j < buffers.len; j++)
+		if (j != buffers.current && buffers.list[j].config.dirty) return 1;
+	return 0;
 }
 
 /*** append ***/
@@ -758,7 +4614,7 @@ struct appendbuf {
 
 // appends a string to the buffer
 void appendToBuffer(struct appendbuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, ab->len + len);
+	char *new = memRealloc(MEM_ABUF, ab->b, ab->len, ab->len + len);
 
 	if (new == NULL) return;
 	// copy string to memory after ab
@@ -772,16 +4628,269 @@ void appendToBuffer(struct appendbuf *ab, const char *s, int len) {
 
 // deallocate buffer
 void freeAppendBuffer(struct appendbuf *ab) {
-	free(ab->b);
+	memFree(MEM_ABUF, ab->b, ab->len);
+}
+
+/*** gutter ***/
+
+// takes the rows as they are on disk as the version changes are shown against
+void editorGutterRebase() {
+	config.saved = memRealloc(MEM_ROWS, config.saved, sizeof(uint64_t) * config.nsaved,
+		sizeof(uint64_t) * config.numrows);
+	config.nsaved = config.numrows;
+	for (int j = 0; j < config.numrows; j++) {
+		config.saved[j] = config.row[j].hash;
+		config.row[j].base = j;
+	}
+}
+
+/*
+ * Myers' diff in linear space: a forward and a backward search meet in the
+ * middle snake of a against b, then either side of it is diffed the same
+ * way. sets keep[j] to a0 plus the line of a matched to b[j] and leaves the
+ * rest alone. v needs 2 * (n + m) + 8 ints.
+ */
+void editorDiffLinear(uint64_t *a, int n, uint64_t *b, int m, int a0, int *keep, int *v) {
+	// equal ends need no search
+	while (n > 0 && m > 0 && a[0] == b[0]) {
+		*keep++ = a0++;
+		a++;
+		b++;
+		n--;
+		m--;
+	}
+	while (n > 0 && m > 0 && a[n - 1] == b[m - 1]) {
+		keep[m - 1] = a0 + n - 1;
+		n--;
+		m--;
+	}
+	if (n == 0 || m == 0) return;
+
+	int max = (n + m + 1) / 2, off = max + 1, delta = n - m;
+	int *vf = v, *vb = &v[2 * max + 3];
+	int d, k, x, y, sx = 0, sy = 0, ex = 0, ey = 0, found = 0;
+	vf[off + 1] = 0;
+	vb[off + 1] = 0;
+	for (d = 0; d <= max && !found; d++) {
+		for (k = -d; k <= d && !found; k += 2) {
+			if (k == -d || (k != d && vf[off + k - 1] < vf[off + k + 1]))
+				x = vf[off + k + 1];
+			else
+				x = vf[off + k - 1] + 1;
+			y = x - k;
+			sx = x;
+			sy = y;
+			while (x < n && y < m && a[x] == b[y]) {
+				x++;
+				y++;
+			}
+			vf[off + k] = x;
+			// with an odd delta the paths can only meet on a forward step
+			if ((delta & 1) && delta - k >= -(d - 1) && delta - k <= d - 1 &&
+			    x + vb[off + delta - k] >= n) {
+				ex = x;
+				ey = y;
+				found = 1;
+			}
+		}
+		// the backward search runs forward over both sequences reversed
+		for (k = -d; k <= d && !found; k += 2) {
+			if (k == -d || (k != d && vb[off + k - 1] < vb[off + k + 1]))
+				x = vb[off + k + 1];
+			else
+				x = vb[off + k - 1] + 1;
+			y = x - k;
+			int rx = x, ry = y;
+			while (x < n && y < m && a[n - 1 - x] == b[m - 1 - y]) {
+				x++;
+				y++;
+			}
+			vb[off + k] = x;
+			if (!(delta & 1) && delta - k >= -d && delta - k <= d &&
+			    x + vf[off + delta - k] >= n) {
+				sx = n - x;
+				sy = m - y;
+				ex = n - rx;
+				ey = m - ry;
+				found = 1;
+			}
+		}
+	}
+	if (!found) return;
+
+	editorDiffLinear(a, sx, b, sy, a0, keep, v);
+	for (x = sx, y = sy; x < ex; x++, y++) keep[y] = a0 + x;
+	editorDiffLinear(&a[ex], n - ex, &b[ey], m - ey, a0 + ex, &keep[ey], v);
+}
+
+// adds saved lines from up to to to the window, cutting the middle out of long runs
+void gutterAppend(int *na, int from, int to) {
+	if (to - from > 2 * GUTTER_RUN) {
+		gutterAppend(na, from, from + GUTTER_RUN);
+		gutter.cut[*na] += to - from - 2 * GUTTER_RUN;
+		from = to - GUTTER_RUN;
+	}
+	for (; from < to; from++) {
+		gutter.a[*na] = config.saved[from];
+		gutter.cut[++*na] = 0;
+	}
+}
+
+/*
+ * marks the rows on screen as added, modified or preceded by deleted lines.
+ * rows remember which saved line they descend from, so the saved lines
+ * around the screen are found without looking at the rest of the file,
+ * and edits have already rehashed just the rows they touched.
+ */
+void editorGutterUpdate() {
+	gutter.count = 0;
+	if (!config.gutter) return;
+	int top = config.rowoff, nb = config.numrows - top;
+	if (nb > config.screenrows) nb = config.screenrows;
+	if (nb <= 0) return;
+
+	// every row and the tail add at most 2 * GUTTER_RUN saved lines
+	int lines = (nb + 1) * 2 * GUTTER_RUN;
+	if (nb > gutter.cap) {
+		// the old sizes follow from cap the same way, nothing was allocated at 0
+		int cap = gutter.cap, had = cap ? (cap + 1) * 2 * GUTTER_RUN : 0;
+		gutter.marks = memRealloc(MEM_INDEX, gutter.marks, cap, nb);
+		gutter.b = memRealloc(MEM_INDEX, gutter.b, sizeof(uint64_t) * cap, sizeof(uint64_t) * nb);
+		gutter.keep = memRealloc(MEM_INDEX, gutter.keep, sizeof(int) * cap, sizeof(int) * nb);
+		gutter.a = memRealloc(MEM_INDEX, gutter.a, sizeof(uint64_t) * had, sizeof(uint64_t) * lines);
+		gutter.cut = memRealloc(MEM_INDEX, gutter.cut, cap ? sizeof(int) * (had + 1) : 0,
+			sizeof(int) * (lines + 1));
+		gutter.v = memRealloc(MEM_INDEX, gutter.v, cap ? sizeof(int) * (2 * (had + cap) + 8) : 0,
+			sizeof(int) * (2 * (lines + nb) + 8));
+		gutter.cap = nb;
+	}
+
+	int na = 0, at = top > 0 ? config.row[top - 1].base + 1 : 0, j;
+	gutter.cut[0] = 0;
+	for (j = 0; j < nb; j++) {
+		erow *row = &config.row[top + j];
+		gutter.b[j] = row->hash;
+		gutter.keep[j] = -1;
+		// saved lines up to the row's own are at or above it
+		int to = row->base + 1 < config.nsaved ? row->base + 1 : config.nsaved;
+		if (to > at) {
+			gutterAppend(&na, at, to);
+			at = to;
+		}
+	}
+	int tail = top + nb == config.numrows;
+	if (tail && at < config.nsaved) gutterAppend(&na, at, config.nsaved);
+	editorDiffLinear(gutter.a, na, gutter.b, nb, 0, gutter.keep, gutter.v);
+
+	// pair the unmatched rows of each hunk with its removed lines
+	at = 0;
+	for (j = 0; j <= nb; ) {
+		int r = j, i;
+		while (r < nb && gutter.keep[r] == -1) r++;
+		int next = r < nb ? gutter.keep[r] : na, removed = next - at;
+		for (i = at; i <= next; i++) removed += gutter.cut[i];
+		for (i = j; i < r; i++) gutter.marks[i] = i - j < removed ? GUTTER_MODIFIED : GUTTER_ADDED;
+		if (r < nb) gutter.marks[r] = removed > r - j ? GUTTER_DELETED : 0;
+		else if (removed > r - j && tail) gutter.marks[nb - 1] |= GUTTER_DELETED_BELOW;
+		at = next + 1;
+		j = r + 1;
+	}
+	gutter.top = top;
+	gutter.count = nb;
+}
+
+// the gutter column for the first screen line of filerow, blank elsewhere
+void editorDrawGutter(struct appendbuf *ab, int filerow, int line) {
+	int m = 0;
+	if (line == 0 && filerow >= gutter.top && filerow < gutter.top + gutter.count)
+		m = gutter.marks[filerow - gutter.top];
+	const char *s = "  ";
+	if (m & GUTTER_ADDED) s = "\x1b[32m+\x1b[39m ";
+	else if (m & GUTTER_MODIFIED) s = "\x1b[33m~\x1b[39m ";
+	else if (m & GUTTER_DELETED) s = "\x1b[31m-\x1b[39m ";
+	else if (m & GUTTER_DELETED_BELOW) s = "\x1b[31m_\x1b[39m ";
+	appendToBuffer(ab, s, strlen(s));
+}
+
+void editorToggleGutter() {
+	if (!config.gutter && config.screencols <= GUTTER_COLS) return;
+	config.gutter = !config.gutter;
+	// rows wrap onto a different number of lines at the new width
+	fenwickInvalidate(&config.layout, 0);
+	editorSetMessage("Changed-line gutter %s", config.gutter ? "on" : "off");
 }
 
 /*** output ***/
 
+// frames go to the terminal, or into memory when running headless
+void editorWriteOut(const char *s, int len) {
+	if (config.headless) {
+		config.sink = realloc(config.sink, len);
+		memcpy(config.sink, s, len);
+		config.sinklen = len;
+		config.sink_total += len;
+		return;
+	}
+	long long prof = profStart();
+	write(STDOUT_FILENO, s, len);
+	profEnd(PROF_WRITE, prof);
+}
+
+// screen line, counted over the whole file, on which row at starts when wrapped
+long long editorWrapLine(int at) {
+	return fenwickSum(&config.layout, at);
+}
+
+// line of the cursor within its wrapped row, and its column on that line
+int editorWrapCursor(int *col) {
+	int rx = config.rx;
+	*col = 0;
+	if (config.cy >= config.numrows) return 0;
+	return editorWrapWalk(&config.row[config.cy], &rx, INT_MAX, col);
+}
+
+// screen line of the cursor relative to the top of the screen when wrapped
+int editorWrapCursorY() {
+	int col;
+	return editorWrapLine(config.cy) + editorWrapCursor(&col) -
+	       editorWrapLine(config.rowoff) - config.wrapoff;
+}
+
+void editorScrollWrapped() {
+	int col, line = editorWrapCursor(&col);
+	config.coloff = 0;
+	if (config.rowoff >= config.numrows) {
+		config.rowoff = config.numrows;
+		config.wrapoff = 0;
+	} else if (config.wrapoff >= editorRowLines(&config.row[config.rowoff])) {
+		config.wrapoff = editorRowLines(&config.row[config.rowoff]) - 1;
+	}
+
+	long long start = editorWrapLine(config.cy), cursor = start + line;
+	long long top = editorWrapLine(config.rowoff) + config.wrapoff;
+	if (cursor < top) {
+		config.rowoff = config.cy;
+		config.wrapoff = line;
+	} else if (cursor >= top + config.screenrows) {
+		// the rows in between fit on the screen, so walking back is cheap
+		long long want = cursor - config.screenrows + 1;
+		int at = config.cy;
+		while (start > want) start -= editorRowLines(&config.row[--at]);
+		config.rowoff = at;
+		config.wrapoff = want - start;
+	}
+}
+
 void editorScroll() {
 	config.rx = 0;
 	if (config.cy < config.numrows) {
+		editorRowThaw(&config.row[config.cy]);
 		config.rx = editorRowCxToRx(&config.row[config.cy], config.cx);
 	}
+	if (config.wrap) {
+		editorScrollWrapped();
+		return;
+	}
 
 	if (config.cy < config.rowoff) {
 		config.rowoff = config.cy;
@@ -792,24 +4901,60 @@ void editorScroll() {
 	if (config.rx < config.coloff) {
 		config.coloff = config.rx;
 	}
-	if (config.rx >= config.coloff + config.screencols) {
-		config.coloff = config.rx - config.screencols + 1;
+	if (config.rx >= config.coloff + editorTextCols()) {
+		config.coloff = config.rx - editorTextCols() + 1;
+	}
+}
+
+// appends one character, showing control characters and invalid bytes inverted
+void editorDrawChar(struct appendbuf *ab, const char *s, int n, int cp, int hl, int *current_color) {
+	if (cp < 0x20 || cp == 0x7f || (cp >= 0x80 && cp < 0xa0)) {
+		// translate ctrl characters to readable characters (invert color)
+		char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+		appendToBuffer(ab, "\x1b[7m", 4);
+		appendToBuffer(ab, &sym, 1);
+		appendToBuffer(ab, "\x1b[m", 3);
+		if (*current_color != -1) {
+			char buf[16];
+			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", *current_color);
+			appendToBuffer(ab, buf, clen);
+		}
+	// revert HL when color != -1 and should be HL_NORMAL
+	} else if (hl == HL_NORMAL) {
+		if (*current_color != -1) {
+			appendToBuffer(ab, "\x1b[39m", 5);
+			*current_color = -1;
+		}
+		appendToBuffer(ab, s, n);
+	// set color when color != current color
+	} else {
+		int color = editorSyntaxToColor(hl);
+		if (color != *current_color) {
+			*current_color = color;
+			char buf[16];
+			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+			appendToBuffer(ab, buf, clen);
+		}
+		appendToBuffer(ab, s, n);
 	}
 }
 
 void editorDrawRows(struct appendbuf *ab) {
 	int y;
+	// the row on the current screen line and, when wrapped, which of its lines
+	int filerow = config.rowoff, line = config.wrap ? config.wrapoff : 0;
+	int cols = editorTextCols();
 	// draw 24 tildes
 	for (y = 0; y < config.screenrows; y++) {
-		int filerow = y + config.rowoff;
+		if (config.gutter) editorDrawGutter(ab, filerow, line);
 		// draw version screen and tildes below text
 		if(filerow >= config.numrows) {
 			if (config.numrows == 0 && y == config.screenrows / 3) {
 				char welcome[80];
 				int welcomelen = snprintf(welcome, sizeof(welcome),
 					"Kilo editor -- version %s", KILO_VERSION);
-				if (welcomelen > config.screencols) welcomelen = config.screencols;
-				int padding = (config.screencols - welcomelen) / 2;
+				if (welcomelen > cols) welcomelen = cols;
+				int padding = (cols - welcomelen) / 2;
 				if (padding) {
 					appendToBuffer(ab, "~", 1);
 					padding--;
@@ -821,44 +4966,59 @@ void editorDrawRows(struct appendbuf *ab) {
 			}
 		// else print rows of text
 		} else {
-			// get row length and char/hl pointers
-			int len = config.row[filerow].rsize - config.coloff;
-			if (len < 0) len = 0;
-			if (len > config.screencols) len = config.screencols;
-			char *c = &config.row[filerow].render[config.coloff];
-			unsigned char *hl = &config.row[filerow].hl[config.coloff];
+			erow *row = &config.row[filerow];
+			editorRowEnsureSyntax(row);
 			int current_color = -1;
-			// iterate over bytes in row
-			int j;
-			for (j = 0; j < len; j++) {
-				// translate ctrl characters to readable characters (invert color)
-				if (iscntrl(c[j])) {
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					appendToBuffer(ab, "\x1b[7m", 4);
-					appendToBuffer(ab, &sym, 1);
-					appendToBuffer(ab, "\x1b[m", 3);
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b%dm", current_color);
-						appendToBuffer(ab, buf, clen);
+			int coloff = config.wrap ? line * cols : config.coloff;
+			// render offset of the bracket partner to show, -1 when off this row
+			int match = filerow == brackets.match_row ? brackets.match_off : -1;
+			if (row->ascii) {
+				// get row length and char/hl pointers
+				int len = row->rsize - coloff;
+				if (len < 0) len = 0;
+				if (len > cols) len = cols;
+				char *c = &row->render[coloff];
+				unsigned char *hl = &row->hl[coloff];
+				// iterate over bytes in row
+				int j;
+				for (j = 0; j < len; j++)
+					editorDrawChar(ab, &c[j], 1, (unsigned char) c[j],
+						coloff + j == match ? HL_MATCH : hl[j], &current_color);
+			} else if (config.wrap && row->wide) {
+				// lines are found the way editorWrapWalk finds them, render has tabs as spaces
+				int j = 0, l = 0, lc = 0;
+				while (j < row->rsize && l <= line) {
+					int cp, n = editorUtf8Decode(&row->render[j], row->rsize - j, &cp);
+					int w = editorCharWidth(cp);
+					if (w > 1 && lc > 0 && lc + w > cols) {
+						l++;
+						lc = 0;
+						continue;
 					}
-				// revert HL when color != -1 and should be HL_NORMAL
-				} else if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						appendToBuffer(ab, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					appendToBuffer(ab, &c[j], 1);
-				// set color when color != current color
-				} else {
-					int color = editorSyntaxToColor(hl[j]);
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						appendToBuffer(ab, buf, clen);
+					if (l == line)
+						editorDrawChar(ab, &row->render[j], n, cp,
+							j == match ? HL_MATCH : row->hl[j], &current_color);
+					lc += w;
+					l += lc / cols;
+					lc %= cols;
+					j += n;
+				}
+			} else {
+				// columns have to be counted from the start of the row
+				int j = 0, col = 0, end = coloff + cols;
+				while (j < row->rsize && col < end) {
+					int cp, n = editorUtf8Decode(&row->render[j], row->rsize - j, &cp);
+					int w = editorCharWidth(cp);
+					if (col + w > end) break;
+					if (col >= coloff) {
+						editorDrawChar(ab, &row->render[j], n, cp,
+							j == match ? HL_MATCH : row->hl[j], &current_color);
+					} else if (col + w > coloff) {
+						// the right half of a wide character at the left edge
+						appendToBuffer(ab, " ", 1);
 					}
-					appendToBuffer(ab, &c[j], 1);
+					col += w;
+					j += n;
 				}
 			}
 			// NOTE: 39m is default text
@@ -867,6 +5027,12 @@ void editorDrawRows(struct appendbuf *ab) {
 
 		appendToBuffer(ab, "\x1b[K", 3);
 		appendToBuffer(ab, "\r\n", 2);
+
+		if (!config.wrap || filerow >= config.numrows ||
+		    ++line >= editorRowLines(&config.row[filerow])) {
+			filerow++;
+			line = 0;
+		}
 	}
 }
 
@@ -874,11 +5040,14 @@ void editorDrawStatusBar(struct appendbuf *ab) {
 	// invert colors
 	appendToBuffer(ab, "\x1b[7m", 4);
 	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+	char which[32] = "";
+	if (buffers.len > 1) snprintf(which, sizeof(which), "[%d/%d] ", buffers.current + 1, buffers.len);
+	int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s", which,
 		config.filename ? config.filename : "[No Name]", config.numrows,
 		config.dirty ? "(modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-		config.syntax ? config.syntax->filetype : "no ft", config.cy + 1, config.numrows);
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | @%lld",
+		config.syntax ? config.syntax->filetype : "no ft", config.cy + 1, config.numrows,
+		fenwickSum(&config.offsets, config.cy) + config.cx);
 	if (len > config.screencols) len = config.screencols;
 	appendToBuffer(ab, status, len);
 	while (len < config.screencols) {
@@ -897,6 +5066,21 @@ void editorDrawStatusBar(struct appendbuf *ab) {
 
 void editorDrawMessageBar(struct appendbuf *ab) {
 	appendToBuffer(ab, "\x1b[K", 3);
+	if (profile.overlay && !config.prompting) {
+		// p50/p99 per stage over every frame so far, bytes per frame last
+		char msg[120];
+		int len = snprintf(msg, sizeof(msg), "us p50/p99");
+		for (int s = 0; s < PROF_STAGES && len < (int) sizeof(msg); s++) {
+			double div = (s == PROF_BYTES) ? 1 : 1000;
+			len += snprintf(&msg[len], sizeof(msg) - len, " %.4s %.0f/%.0f", PROF_NAMES[s],
+				profPercentile(s, 0.5) / div, profPercentile(s, 0.99) / div);
+		}
+		// a truncated snprintf reports the length it wanted
+		if (len >= (int) sizeof(msg)) len = sizeof(msg) - 1;
+		if (len > config.screencols) len = config.screencols;
+		appendToBuffer(ab, msg, len);
+		return;
+	}
 	int msglen = strlen(config.statusmsg);
 	if (msglen > config.screencols) msglen = config.screencols;
 	// show message for 5 seconds
@@ -905,34 +5089,88 @@ void editorDrawMessageBar(struct appendbuf *ab) {
 }
 
 void editorRefreshScreen() {
+	// a replaying macro shows only its final state
+	if (macro.replaying) return;
+	long long frame = profStart();
+	editorSyntaxSchedule();
 	editorScroll();
+	editorBracketsUpdateMatch();
+	editorGutterUpdate();
 
 	struct appendbuf ab = ABUF_INIT;
 
+	// the terminal holds the frame back until the end marker, so it never tears
+	appendToBuffer(&ab, "\x1b[?2026h", 8);
 	// hide cursor and move cursor top left
 	appendToBuffer(&ab, "\x1b[?25l", 6);
 	appendToBuffer(&ab, "\x1b[H", 3);
 
 	// draw
+	long long draw = profStart();
 	editorDrawRows(&ab);
 	editorDrawStatusBar(&ab);
 	editorDrawMessageBar(&ab);
+	profEnd(PROF_DRAW, draw);
 	
-	// move cursor to current position
+	// move cursor to current position, past the gutter
 	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
-	         (config.cy - config.rowoff) + 1,
-			 (config.rx - config.coloff) + 1);
+	int gutter_cols = config.gutter ? GUTTER_COLS : 0, col;
+	if (config.wrap) {
+		editorWrapCursor(&col);
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editorWrapCursorY() + 1,
+		         col + gutter_cols + 1);
+	} else
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
+		         (config.cy - config.rowoff) + 1,
+				 (config.rx - config.coloff) + gutter_cols + 1);
 	appendToBuffer(&ab, buf, strlen(buf));
 
 	// show cursor
 	appendToBuffer(&ab, "\x1b[?25h", 6);
+	appendToBuffer(&ab, "\x1b[?2026l", 8);
 
 	// write and erase buffer
-	write(STDOUT_FILENO, ab.b, ab.len);
+	editorWriteOut(ab.b, ab.len);
+	profEnd(PROF_FRAME, frame);
+	profEndFrame(ab.len);
 	freeAppendBuffer(&ab);
 }
 
+long long editorNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * waits until the next frame may be drawn: the terminal has drained the
+ * last one and a frame interval has passed. keys arriving meanwhile are
+ * applied right away, so a held key costs one frame per interval instead
+ * of one per repeat.
+ */
+void editorPaceFrame() {
+	while (1) {
+		long long wait = config.frame_last + config.frame_interval - editorNow();
+		struct pollfd fds[2] = {
+			{ .fd = STDIN_FILENO, .events = POLLIN },
+			{ .fd = STDOUT_FILENO, .events = POLLOUT }
+		};
+		if (poll(fds, 2, 0) == -1 && errno != EINTR) return;
+		int writable = fds[1].revents != 0;
+		if (writable && wait <= 0) break;
+		// a hangup wakes poll too, and the read then exits on it
+		if (fds[0].revents) {
+			editorProcessKeypress();
+			continue;
+		}
+		// idle until a key arrives, the terminal drains or the interval ends
+		if (poll(fds, writable ? 1 : 2, writable ? (wait + 999) / 1000 : -1) == -1 &&
+		    errno != EINTR)
+			return;
+	}
+	config.frame_last = editorNow();
+}
+
 void editorSetMessage(const char *fmt, ...) {
 	// v stands for variadic function (multiple arguments)
 	va_list ap;
@@ -942,14 +5180,39 @@ void editorSetMessage(const char *fmt, ...) {
 	config.statusmsg_time = time(NULL);
 }
 
+// live bytes per category in the message bar, peak shown for frame buffers
+void editorShowMemory() {
+	char msg[256], num[16];
+	long long total = 0;
+	int len = snprintf(msg, sizeof(msg), "mem");
+	for (int k = 0; k < MEM_KINDS; k++) {
+		memHuman(num, sizeof(num), memory.live[k]);
+		len += snprintf(&msg[len], sizeof(msg) - len, " %s %s", MEM_NAMES[k], num);
+		if (k == MEM_ABUF) {
+			memHuman(num, sizeof(num), memory.peak[k]);
+			len += snprintf(&msg[len], sizeof(msg) - len, "/%s", num);
+		}
+		total += memory.live[k];
+	}
+	memHuman(num, sizeof(num), total);
+	snprintf(&msg[len], sizeof(msg) - len, " = %s", num);
+	editorSetMessage("%s", msg);
+	if (memory.dump) memDump();
+}
+
 /*** input ***/
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+	return editorPromptWith(prompt, callback, 0);
+}
+
+char *editorPromptWith(char *prompt, void (*callback)(char *, int), int allow_empty) {
 	size_t bufsize = 128;
-	char *buf = malloc(bufsize);
+	char *buf = memRealloc(MEM_PROMPT, NULL, 0, bufsize);
 
 	size_t buflen = 0;
 	buf[0] = '\0';
+	config.prompting++;
 
 	while (1) {
 		editorSetMessage(prompt, buf);
@@ -960,19 +5223,23 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 			if (buflen != 0) buf[--buflen] = '\0';
 		} else if (c == '\x1b') {
 			editorSetMessage("");
+			config.prompting--;
 			if (callback) callback(buf, c);
-			free(buf);
+			memFree(MEM_PROMPT, buf, bufsize);
 			return NULL;
 		} else if (c == '\r') {
-			if (buflen != 0) {
+			if (buflen != 0 || allow_empty) {
 				editorSetMessage("");
+				config.prompting--;
 				if (callback) callback(buf, c);
+				// the caller owns the answer from here on
+				memAccount(MEM_PROMPT, -(long long) bufsize);
 				return buf;
 			}
-		} else if (!iscntrl(c) && c < 128) {
+		} else if ((c < 128 && !iscntrl(c)) || (c >= 128 && c < 256)) {
 			if (buflen == bufsize - 1) {
+				buf = memRealloc(MEM_PROMPT, buf, bufsize, bufsize * 2);
 				bufsize *= 2;
-				buf = realloc(buf, bufsize);
 			}
 			buf[buflen++] = c;
 			buf[buflen] = '\0';
@@ -981,19 +5248,48 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 		if (callback) callback(buf, c);
 	}
 }
+/*
+ * pages by screen lines rather than rows when wrapped, moving the cursor
+ * a screen past the edge it is pushed to like the unwrapped keys do
+ */
+void editorPageWrapped(int key) {
+	long long top = editorWrapLine(config.rowoff) + config.wrapoff, rem;
+	long long line = key == PAGE_UP ? top - config.screenrows : top + 2 * config.screenrows - 1;
+	long long total = editorWrapLine(config.numrows);
+	if (line < 0) line = 0;
+	if (line > total) line = total;
+	config.cy = fenwickFind(&config.layout, line, &rem);
+	config.cx = 0;
+	if (config.cy < config.numrows) {
+		erow *row = &config.row[config.cy];
+		editorRowThaw(row);
+		int rx = INT_MAX, col;
+		editorWrapWalk(row, &rx, rem, &col);
+		config.cx = editorRowRxToCx(row, rx);
+	}
+}
+
+void editorToggleWrap() {
+	config.wrap = !config.wrap;
+	config.wrapoff = 0;
+	config.coloff = 0;
+	editorSetMessage("Soft wrap %s", config.wrap ? "on" : "off");
+}
+
 void editorMoveCursor(int key) {
 	erow *row = (config.cy >= config.numrows) ? NULL : &config.row[config.cy];
+	if (row) editorRowThaw(row);
 
 	switch (key) {
 		case ARROW_LEFT: 
-			if (config.cx != 0) config.cx--;
+			if (config.cx != 0) config.cx = editorRowPrevChar(row, config.cx);
 			else if (config.cy > 0) {
 				config.cy--;
 				config.cx = config.row[config.cy].size;
 			}
 			break;
 		case ARROW_RIGHT:
-			if (row && config.cx < row->size) config.cx++;
+			if (row && config.cx < row->size) config.cx = editorRowNextChar(row, config.cx);
 			else if (row && config.cx == row->size) {
 				config.cy++;
 				config.cx = 0;
@@ -1012,12 +5308,65 @@ void editorMoveCursor(int key) {
 	if (config.cx > rowlen) {
 		config.cx = rowlen;
 	}
+	// the same byte index may fall inside a character on another row
+	if (row) {
+		editorRowThaw(row);
+		config.cx = editorRowSnapCx(row, config.cx);
+	}
 }
 
-void editorProcessKeypress() {
-	static int quit_times = KILO_QUIT_TIMES;
+void editorMacroToggle() {
+	if (!macro.recording) {
+		macro.len = 0;
+		macro.recording = 1;
+		editorSetMessage("Recording macro, Ctrl-K to stop");
+		return;
+	}
+	// drop the Ctrl-K that ended the recording
+	macro.recording = 0;
+	if (macro.len > 0) macro.len--;
+	editorSetMessage("Recorded a macro of %d keys, Ctrl-E to run it", macro.len);
+}
 
-	int c = editorReadKey();
+/*
+ * replays the macro n times, or while each pass moves the cursor further
+ * down the file. no frames are drawn and syntax is settled once at the end.
+ */
+void editorMacroRun() {
+	if (macro.recording || macro.replaying) return;
+	if (macro.len == 0) {
+		editorSetMessage("No macro recorded, Ctrl-K starts recording");
+		return;
+	}
+	char *answer = editorPrompt("Run macro: %s times (0 = to end of file, ESC to cancel)", NULL);
+	if (answer == NULL) return;
+	int times = atoi(answer);
+	free(answer);
+
+	int runs = 0;
+	macro.replaying = 1;
+	config.hl_defer = 1;
+	while (times > 0 ? runs < times : config.cy < config.numrows) {
+		int cy = config.cy;
+		for (int j = 0; j < macro.len; j++) editorQueueKey(macro.keys[j]);
+		while (config.keys_len > 0) {
+			editorProcessKeypress();
+			// no frames are drawn, but paging moves relative to the scroll position
+			editorScroll();
+		}
+		runs++;
+		// a pass that does not move down would never reach the end
+		if (times <= 0 && config.cy <= cy) break;
+	}
+	config.hl_defer = 0;
+	if (config.hl_pending) editorSyntaxFlush();
+	macro.replaying = 0;
+	editorSetMessage("Ran the macro %d time%s", runs, runs == 1 ? "" : "s");
+}
+
+void editorHandleKey(int c) {
+	static int quit_times = KILO_QUIT_TIMES;
+	static int overwrite_times = KILO_OVERWRITE_TIMES;
 
 	switch (c) {
 		case '\r':
@@ -1025,9 +5374,10 @@ void editorProcessKeypress() {
 			break;
 		// Exit key
 		case CTRL_KEY('q'):
-			if (config.dirty && quit_times > 0) {
+			if (editorBuffersDirty() && quit_times > 0) {
 				editorSetMessage("WARNING! File has unsaved changes. "
-					"Press CTRL-Q %d more times to quit.", quit_times);
+					"Press CTRL-Q %d more time%s to quit.", quit_times,
+					quit_times == 1 ? "" : "s");
 				quit_times--;
 				return;
 			}
@@ -1037,6 +5387,13 @@ void editorProcessKeypress() {
 			exit(0);
 			break;
 		case CTRL_KEY('s'):
+			if (editorFileChanged() && overwrite_times > 0) {
+				editorSetMessage("WARNING! File changed on disk. "
+					"Press CTRL-S %d more time%s to overwrite it.", overwrite_times,
+					overwrite_times == 1 ? "" : "s");
+				overwrite_times--;
+				return;
+			}
 			editorSave();
 			break;
 
@@ -1059,6 +5416,46 @@ void editorProcessKeypress() {
 		case CTRL_KEY('f'):
 			editorFind();
 			break;
+		case CTRL_KEY('r'):
+			editorReplace();
+			break;
+		case CTRL_KEY('g'):
+			editorGoto();
+			break;
+		case CTRL_KEY('n'):
+			editorComplete();
+			break;
+		case CTRL_KEY('b'):
+			editorBracketJump();
+			break;
+		case CTRL_KEY('d'):
+			editorToggleGutter();
+			break;
+		case CTRL_KEY('w'):
+			editorToggleWrap();
+			break;
+		case CTRL_KEY('o'):
+			editorBufferPrompt();
+			break;
+		case CTRL_KEY('t'):
+			editorBufferNext();
+			break;
+		case CTRL_KEY('x'):
+			editorSort();
+			break;
+		case CTRL_KEY('k'):
+			editorMacroToggle();
+			break;
+		case CTRL_KEY('e'):
+			editorMacroRun();
+			break;
+		case CTRL_KEY('u'):
+			editorShowMemory();
+			break;
+		case CTRL_KEY('p'):
+			profile.overlay = !profile.overlay;
+			profile.enabled = profile.overlay || profile.dump;
+			break;
 		case BACKSPACE:
 		case CTRL_KEY('h'):
 		case DEL_KEY:
@@ -1067,6 +5464,10 @@ void editorProcessKeypress() {
 			break;
 		case PAGE_UP:
 		case PAGE_DOWN:
+			if (config.wrap) {
+				editorPageWrapped(c);
+				break;
+			}
 			{
 				if (c == PAGE_UP) {
 					config.cy = config.rowoff;
@@ -1080,6 +5481,11 @@ void editorProcessKeypress() {
 				}
 			}
 			break;
+		// the bindings the startup help had no room for
+		case CTRL_KEY('a'):
+			editorSetMessage("^K/^E macro ^N complete ^B bracket ^W wrap ^X sort ^D changes ^P/^U stats");
+			break;
+
 		case CTRL_KEY('l'):
 		case '\x1b':
 			break;
@@ -1090,45 +5496,596 @@ void editorProcessKeypress() {
 	}
 
 	quit_times = KILO_QUIT_TIMES;
+	overwrite_times = KILO_OVERWRITE_TIMES;
+}
+
+// packs cold rows until a key arrives
+// one slice of background work, 0 once there is none left
+int editorIdleWork() {
+	return editorIndexRows(COLD_SCAN) || editorTrigramRows(COLD_SCAN / 8) ||
+	       editorBracketRows(COLD_SCAN / 16) || editorFreezeRows();
+}
+
+void editorWaitForKey() {
+	struct pollfd fd = { .fd = STDIN_FILENO, .events = POLLIN };
+	while (poll(&fd, 1, 0) == 0 && editorIdleWork());
+}
+
+void editorProcessKeypress() {
+	int c = editorReadKey();
+	// rows untouched for long enough may be packed again
+	cold.clock++;
+	cold.idle = 0;
+	// only time spent handling the key, not waiting for it
+	long long prof = profStart();
+	editorHandleKey(c);
+	profEnd(PROF_INPUT, prof);
+}
+
+void editorRun() {
+	editorSetMessage("HELP: ^S save ^Q quit ^F find ^R replace ^G goto ^O open ^T next file ^A more");
+
+	// runtime loop
+	while(1) {
+		editorCheckFileChanged();
+		editorPaceFrame();
+		editorRefreshScreen();
+		editorWaitForKey();
+		editorProcessKeypress();
+	}
 }
 
 /*** init ***/
 
-void initEditor() {
+// empties the per-file state, which buffers keep their own copies of
+void editorInitBuffer() {
 	config.cx = 0;
 	config.cy = 0;
 	config.rx = 0;
 	config.rowoff = 0;
 	config.coloff = 0;
+	config.wrap = 0;
+	config.wrapoff = 0;
 	config.numrows = 0;
 	config.row = NULL;
+	config.rowcap = 0;
 	config.dirty = 0;
 	config.filename = NULL;
+	config.syntax = NULL;
+	config.hl_trans = NULL;
+	config.hl_state = NULL;
+	config.hl_valid = 0;
+	config.hl_dirty = 0;
+	config.offsets.tree = NULL;
+	config.offsets.cap = 0;
+	config.offsets.stale = 0;
+	config.offsets.value = editorRowBytes;
+	config.layout.tree = NULL;
+	config.layout.cap = 0;
+	config.layout.stale = 0;
+	config.layout.value = editorRowLines;
+	config.file_known = 0;
+	config.file_checked = 0;
+	config.file_conflict = 0;
+	config.saved = NULL;
+	config.nsaved = 0;
+	config.hl_pending = 0;
+	config.hl_version = ++highlighter.version;
+}
+
+void initEditor() {
+	editorInitBuffer();
 	config.statusmsg[0] = '\0';
 	config.statusmsg_time = 0;
-	config.syntax = NULL;
 
-	if (getWindowSize(&config.screenrows, &config.screencols) == -1) 
+	config.keys_len = 0;
+	config.keys_pos = 0;
+
+	if (config.headless) {
+		config.screenrows = 24;
+		config.screencols = 80;
+	} else if (getWindowSize(&config.screenrows, &config.screencols) == -1)
 		die("getWindowSize");
 
 	// decrementing screenrows leaves a row for the status bar
 	config.screenrows -= 2;
 }
 
-int main(int argc, char *argv[]) {
-	enableRawMode();
+/*** bench ***/
+
+struct benchStat {
+	const char *op;
+	double *us;
+	int len;
+	int cap;
+};
+
+double benchNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void benchRecord(struct benchStat *st, double us) {
+	if (st->len == st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 64;
+		st->us = realloc(st->us, sizeof(double) * st->cap);
+	}
+	st->us[st->len++] = us;
+}
+
+int benchCompare(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+void benchReport(const char *file, struct benchStat *st) {
+	if (st->len == 0) return;
+	qsort(st->us, st->len, sizeof(double), benchCompare);
+	printf("%-14s %-8s %6d %10.1f %10.1f %10.1f %10.1f\n", file, st->op, st->len,
+		st->us[(st->len - 1) / 2], st->us[(int) ((st->len - 1) * 0.9)],
+		st->us[(int) ((st->len - 1) * 0.99)], st->us[st->len - 1]);
+	free(st->us);
+	st->us = NULL;
+	st->len = st->cap = 0;
+}
+
+// one sample per key: handle it and render the resulting frame
+void benchKeys(struct benchStat *st, int key, int times) {
+	while (times--) {
+		double start = benchNow();
+		editorQueueKey(key);
+		editorProcessKeypress();
+		editorRefreshScreen();
+		benchRecord(st, benchNow() - start);
+	}
+}
+
+void benchCloseFile() {
+	editorCloseFile();
 	initEditor();
-	if (argc >= 2) {
-		editorOpen(argv[1]);
+}
+
+void benchGenerate(const char *path, int kind, int scale) {
+	FILE *fp = fopen(path, "w");
+	if (!fp) die("fopen");
+	int j, k;
+	switch (kind) {
+		// plenty of ordinary C
+		case 0:
+			for (j = 0; j < 200000 * scale; j++)
+				fprintf(fp, "\tint value_%d = compute(%d, \"str %d\"); // note %d\n", j, j, j, j);
+			break;
+		// few rows, each far wider than the screen
+		case 1:
+			for (j = 0; j < 2000 * scale; j++) {
+				for (k = 0; k < 1000; k++) fprintf(fp, "word%03d ", k);
+				fputc('\n', fp);
+			}
+			break;
+		// tab indented and tab separated
+		case 2:
+			for (j = 0; j < 100000 * scale; j++)
+				fprintf(fp, "%.*s{\t%d\t\t%d\t}\n", j % 12, "\t\t\t\t\t\t\t\t\t\t\t\t", j, j * 7);
+			break;
+		// long block comments so every edit reflows comment state below it
+		case 3:
+			for (j = 0; j < 2000 * scale; j++) {
+				fprintf(fp, "/* block %d\n", j);
+				for (k = 0; k < 40; k++) fprintf(fp, " * \"%d\" /* nested-looking %d\n", k, j);
+				fprintf(fp, " */ int code_%d = %d; /* inline */ // tail\n", j, j);
+			}
+			break;
 	}
+	fclose(fp);
+}
 
-	editorSetMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+// opens synthetic files headless and reports per-operation latency in microseconds
+int editorBench(int scale) {
+	static const char *files[] = { "huge.c", "longlines.txt", "tabs.c", "comments.c" };
+	char dir[] = "/tmp/kilo-bench-XXXXXX";
+	char path[64];
+	struct benchStat open_st = { "open", NULL, 0, 0 };
+	struct benchStat type_st = { "type", NULL, 0, 0 };
+	struct benchStat newline_st = { "newline", NULL, 0, 0 };
+	struct benchStat search_st = { "search", NULL, 0, 0 };
+	struct benchStat scroll_st = { "scroll", NULL, 0, 0 };
+	struct benchStat wrap_st = { "wscroll", NULL, 0, 0 };
+	struct benchStat save_st = { "save", NULL, 0, 0 };
+	struct benchStat sort_st = { "sort", NULL, 0, 0 };
+	unsigned int f;
+	int j;
 
-	// runtime loop
-	while(1) {
+	if (scale < 1) scale = 1;
+	if (!mkdtemp(dir)) die("mkdtemp");
+	config.headless = 1;
+	initEditor();
+
+	printf("%-14s %-8s %6s %10s %10s %10s %10s\n", "file", "op", "n", "p50 us", "p90 us",
+		"p99 us", "max us");
+	for (f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, files[f]);
+		benchGenerate(path, f, scale);
+
+		for (j = 0; j < 3; j++) {
+			double start = benchNow();
+			editorOpen(path);
+			benchRecord(&open_st, benchNow() - start);
+			if (j < 2) benchCloseFile();
+		}
+
+		// edit in the middle so syntax changes have rows on both sides
+		config.cy = config.numrows / 2;
 		editorRefreshScreen();
-		editorProcessKeypress();
+		benchKeys(&type_st, 'x', 200);
+		benchKeys(&type_st, BACKSPACE, 100);
+		benchKeys(&newline_st, '\r', 100);
+		benchKeys(&scroll_st, PAGE_DOWN, 100);
+		benchKeys(&scroll_st, ARROW_DOWN, 300);
+		benchKeys(&scroll_st, PAGE_UP, 100);
+		// the same soft wrapped, which should cost no more
+		editorToggleWrap();
+		benchKeys(&wrap_st, PAGE_DOWN, 100);
+		benchKeys(&wrap_st, ARROW_DOWN, 300);
+		benchKeys(&wrap_st, PAGE_UP, 100);
+		editorToggleWrap();
+
+		// searches for text that is nowhere in the file, so every row is scanned
+		for (j = 0; j < 10; j++) {
+			const char *query = "zz-not-there";
+			double start = benchNow();
+			editorQueueKey(CTRL_KEY('f'));
+			while (*query) editorQueueKey(*query++);
+			editorQueueKey('\r');
+			editorProcessKeypress();
+			editorRefreshScreen();
+			benchRecord(&search_st, benchNow() - start);
+		}
+
+		for (j = 0; j < 5; j++) {
+			double start = benchNow();
+			editorSave();
+			benchRecord(&save_st, benchNow() - start);
+		}
+
+		// the whole file from the prompt, reopened each time so it starts unsorted
+		for (j = 0; j < 3; j++) {
+			benchCloseFile();
+			editorOpen(path);
+			double start = benchNow();
+			editorQueueKey(CTRL_KEY('x'));
+			editorQueueKey('\r');
+			editorProcessKeypress();
+			editorRefreshScreen();
+			benchRecord(&sort_st, benchNow() - start);
+		}
+
+		benchReport(files[f], &open_st);
+		benchReport(files[f], &type_st);
+		benchReport(files[f], &newline_st);
+		benchReport(files[f], &search_st);
+		benchReport(files[f], &scroll_st);
+		benchReport(files[f], &wrap_st);
+		benchReport(files[f], &save_st);
+		benchReport(files[f], &sort_st);
+		benchCloseFile();
+		unlink(path);
 	}
+	rmdir(dir);
+	printf("%lld bytes rendered\n", config.sink_total);
+	return 0;
+}
+
+/*** server ***/
+
+// what a client sends along with its terminal
+struct serverRequest {
+	char cwd[PATH_MAX];
+	char name[PATH_MAX];
+};
+
+/*
+ * kilo.sock in $XDG_RUNTIME_DIR/kilo, or in /tmp/kilo-UID. the server makes
+ * the directory; it has to be the user's own and closed to everyone else,
+ * or anyone could hand the server a terminal or pose as it to a client.
+ */
+int editorServerPath(struct sockaddr_un *addr, int create) {
+	char dir[96];
+	const char *base = getenv("XDG_RUNTIME_DIR");
+	if (base && *base) snprintf(dir, sizeof(dir), "%.80s/kilo", base);
+	else snprintf(dir, sizeof(dir), "/tmp/kilo-%d", (int) getuid());
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/kilo.sock", dir);
+
+	struct stat st;
+	if (create && mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+	if (lstat(dir, &st) == -1) return -1;
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+		errno = EACCES;
+		return -1;
+	}
+	return 0;
+}
+
+// the process at the other end of the socket runs as this user
+int editorServerPeerOk(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+int editorServerConnect(struct sockaddr_un *addr) {
+	struct stat st;
+	if (lstat(addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) return -1;
+	if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) == -1 || !editorServerPeerOk(fd)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * hands the terminal to a running server, which edits name in a copy of
+ * the buffer it keeps loaded. returns only if no server took it over.
+ */
+void editorAttach(const char *name) {
+	struct sockaddr_un addr;
+	if (editorServerPath(&addr, 0) == -1) return;
+	int fd = editorServerConnect(&addr);
+	if (fd == -1) return;
+
+	struct serverRequest req;
+	memset(&req, 0, sizeof(req));
+	struct termios term;
+	if (!getcwd(req.cwd, sizeof(req.cwd)) || strlen(name) >= sizeof(req.name) ||
+	    tcgetattr(STDIN_FILENO, &term) == -1) {
+		close(fd);
+		return;
+	}
+	strcpy(req.name, name);
+
+	int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control, .msg_controllen = sizeof(control)
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	// the server acknowledges once its editor owns the terminal
+	char ack;
+	if (sendmsg(fd, &msg, 0) != (ssize_t) sizeof(req) || read(fd, &ack, 1) != 1) {
+		close(fd);
+		return;
+	}
+	// and the connection closes when that editor exits, however it does
+	ssize_t n;
+	while ((n = read(fd, &ack, 1)) > 0 || (n == -1 && errno == EINTR));
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &term);
+	exit(0);
+}
+
+// binds the socket, taking over one left behind by a server that is gone
+int editorServerListen(struct sockaddr_un *addr) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) return -1;
+	// the socket is created 0600, on top of the directory being private
+	mode_t mask = umask(077);
+	int bound = bind(fd, (struct sockaddr *) addr, sizeof(*addr));
+	if (bound == -1) {
+		int stale = errno == EADDRINUSE;
+		if (stale) {
+			int live = editorServerConnect(addr);
+			if (live != -1) {
+				close(live);
+				stale = 0;
+				errno = EADDRINUSE;
+			}
+		}
+		if (stale && unlink(addr->sun_path) == 0)
+			bound = bind(fd, (struct sockaddr *) addr, sizeof(*addr));
+	}
+	umask(mask);
+	if (bound == -1 || listen(fd, 16) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// shows the buffer for path, reading the file only if no buffer has it yet
+void editorServerShow(const char *path) {
+	int at = editorBufferFind(path);
+	if (at != -1) editorBufferShow(at);
+	else if (buffers.len == 0 && !config.filename) editorBufferOpen(path);
+	else editorBufferAdd(path, 0);
+	// server buffers are never edited, so a stat and the hashes of the rows
+	// are enough to bring one up to date with the file
+	if (editorFileChanged()) editorReloadFile();
+}
+
+// runs the editor for a client on its terminal, with the buffer just shown
+void editorServerChild(int conn, int *fds, struct serverRequest *req) {
+	dup2(fds[0], STDIN_FILENO);
+	dup2(fds[1], STDOUT_FILENO);
+	close(fds[0]);
+	close(fds[1]);
+	config.client = conn;
+	signal(SIGCHLD, SIG_DFL);
+	// relative names and saves resolve where the client runs
+	if (chdir(req->cwd) == 0) {
+		free(config.filename);
+		config.filename = strdup(req->name);
+	}
+	// the server never ran the highlighter thread, so its lock and condition
+	// variable are untouched and the child starts its own on demand
+	// the other buffers are the server's, not this editor's
+	buffers.list = NULL;
+	buffers.len = buffers.cap = buffers.current = 0;
+	// a reload may have moved the server's view, the client starts at the top
+	config.cx = config.cy = 0;
+	config.rowoff = config.coloff = config.wrapoff = 0;
+
+	enableRawMode();
+	int cols = editorTextCols();
+	if (getWindowSize(&config.screenrows, &config.screencols) == -1) die("getWindowSize");
+	config.screenrows -= 2;
+	if (editorTextCols() != cols) fenwickInvalidate(&config.layout, 0);
+	if (write(conn, "k", 1) != 1) exit(1);
+	editorRun();
+}
+
+void editorServeClient(int listener, int conn) {
+	struct serverRequest req;
+	int fds[2] = { -1, -1 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control, .msg_controllen = sizeof(control)
+	};
+	ssize_t n = recvmsg(conn, &msg, MSG_WAITALL);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	char joined[2 * PATH_MAX], path[2 * PATH_MAX];
+	int ok = n == (ssize_t) sizeof(req) && fds[0] != -1 && fds[1] != -1;
+	if (ok) {
+		req.cwd[PATH_MAX - 1] = req.name[PATH_MAX - 1] = '\0';
+		if (req.name[0] == '/') snprintf(joined, sizeof(joined), "%s", req.name);
+		else snprintf(joined, sizeof(joined), "%s/%s", req.cwd, req.name);
+		if (!realpath(joined, path)) strcpy(path, joined);
+		// a file that cannot be read is left to the client to report
+		ok = access(path, F_OK) == -1 || access(path, R_OK) == 0;
+	}
+	if (ok) {
+		editorServerShow(path);
+		if (fork() == 0) {
+			close(listener);
+			editorServerChild(conn, fds, &req);
+		}
+	}
+	if (fds[0] != -1) close(fds[0]);
+	if (fds[1] != -1) close(fds[1]);
+	close(conn);
+}
+
+/*
+ * --server: detaches, loads files and keeps them parsed and highlighted
+ * until killed. each client gets a forked copy, so its edits never reach
+ * the server and opening costs a fork instead of a read.
+ */
+int editorServer(int argc, char *argv[], int arg) {
+	struct sockaddr_un addr;
+	int listener = editorServerPath(&addr, 1) == -1 ? -1 : editorServerListen(&addr);
+	if (listener == -1) {
+		fprintf(stderr, "kilo: can't listen on %s: %s\n", addr.sun_path, strerror(errno));
+		return 1;
+	}
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return 1;
+	}
+	if (pid > 0) {
+		printf("kilo server %d listening on %s\n", (int) pid, addr.sun_path);
+		return 0;
+	}
+	setsid();
+	int null = open("/dev/null", O_RDWR);
+	dup2(null, STDIN_FILENO);
+	dup2(null, STDOUT_FILENO);
+	dup2(null, STDERR_FILENO);
+	if (null > STDERR_FILENO) close(null);
+	// clients' editors are reaped as they exit
+	signal(SIGCHLD, SIG_IGN);
+
+	// until a client brings its terminal
+	editorInitBuffer();
+	config.screenrows = 22;
+	config.screencols = 80;
+	char path[PATH_MAX];
+	for (; arg < argc; arg++)
+		if (realpath(argv[arg], path)) editorServerShow(path);
+
+	struct pollfd fd = { .fd = listener, .events = POLLIN };
+	while (1) {
+		// the shown buffer's comment states are finished and it is indexed
+		// while nobody is attaching. the states are worked out here rather
+		// than on the highlighter thread: forking a process with a second
+		// thread would hand the client a lock and condition variable in
+		// whatever state that thread left them
+		while (poll(&fd, 1, 0) == 0) {
+			if (config.hl_valid < config.numrows) editorSyntaxAdvance(COLD_SCAN);
+			else if (!editorIdleWork()) break;
+		}
+		if (poll(&fd, 1, -1) <= 0) continue;
+		int conn = accept(listener, NULL, NULL);
+		if (conn == -1) continue;
+		// only this user's own clients may hand over a terminal
+		if (editorServerPeerOk(conn)) editorServeClient(listener, conn);
+		else close(conn);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc >= 2 && !strcmp(argv[1], "--bench"))
+		return editorBench(argc >= 3 ? atoi(argv[2]) : 1);
+
+	config.frame_interval = 1000000 / FRAME_RATE;
+	int arg = 1, serve = 0;
+	while (arg < argc) {
+		if (!strcmp(argv[arg], "--index")) {
+			config.trigrams = 1;
+			arg++;
+			continue;
+		} else if (!strcmp(argv[arg], "--server")) {
+			serve = 1;
+			arg++;
+			continue;
+		} else if (arg + 1 == argc) {
+			break;
+		} else if (!strcmp(argv[arg], "--profile")) {
+			profile.dump = argv[arg + 1];
+			profile.enabled = 1;
+			atexit(profDump);
+		} else if (!strcmp(argv[arg], "--fps")) {
+			int fps = atoi(argv[arg + 1]);
+			config.frame_interval = fps > 0 ? 1000000 / fps : 0;
+		} else if (!strcmp(argv[arg], "--mem-dump")) {
+			memory.dump = argv[arg + 1];
+			atexit(memDump);
+		} else if (!strcmp(argv[arg], "--budget")) {
+			buffers.budget = atoll(argv[arg + 1]) << 20;
+		} else {
+			break;
+		}
+		arg += 2;
+	}
+	if (serve) return editorServer(argc, argv, arg);
+	// a plain `kilo file` goes to a running server, which has it loaded already
+	if (arg == 1 && argc == 2 && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) editorAttach(argv[1]);
+
+	enableRawMode();
+	initEditor();
+	if (argc > arg) {
+		editorOpen(argv[arg]);
+	}
+	// the rest are read once they are switched to
+	for (int j = arg + 1; j < argc; j++) editorBufferAdd(argv[j], 1);
+
+	editorRun();
 	return 0; 
 }
 